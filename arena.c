@@ -0,0 +1,148 @@
+/**
+ * @file arena.c
+ * @brief Arena allocator for GATT object lifetimes.
+ *
+ * All attributes of a service are carved out of a few large chunks and
+ * released in one go when the service is removed, instead of one malloc and
+ * free per structure, UUID and object path.
+ */
+
+#include "hrp.h"
+
+/* Allocations are aligned like malloc() does it */
+#define ARENA_ALIGN     _Alignof(max_align_t)
+
+/**
+ * @struct arena_chunk
+ * Represents one block of memory handed out by the arena
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	_Alignas(max_align_t) uint8_t data[];
+};
+
+/**
+ * @struct arena
+ * Represents the arena, the newest chunk comes first
+ */
+struct arena {
+	struct arena_chunk *chunks;
+	size_t chunk_size;
+};
+
+/**
+ * @brief This function is used to create an arena.
+ *
+ * @param chunk_size    The size of the chunks allocated from the heap.
+ *
+ * @return A pointer to the arena.
+ */
+struct arena *arena_new(size_t chunk_size)
+{
+	struct arena *arena;
+
+	arena = g_new0(struct arena, 1);
+	arena->chunk_size = chunk_size ? chunk_size : 4096;
+
+	return arena;
+}
+
+/**
+ * @brief This function is used to allocate zeroed memory from an arena.
+ *
+ * @param arena A pointer to the arena.
+ * @param size  Number of bytes to allocate.
+ *
+ * @return A pointer to the memory, valid until arena_free().
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = MAX(arena->chunk_size, size);
+
+		chunk = g_malloc0(sizeof(*chunk) + chunk_size);
+		chunk->size = chunk_size;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+/**
+ * @brief This function is used to copy a string into an arena.
+ *
+ * @param arena A pointer to the arena.
+ * @param str   The string to be copied.
+ *
+ * @return A pointer to the copy, NULL if str is NULL.
+ */
+char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t len;
+
+	if (!str)
+		return NULL;
+
+	len = strlen(str) + 1;
+
+	return memcpy(arena_alloc(arena, len), str, len);
+}
+
+/**
+ * @brief This function is used to format a string into an arena.
+ *
+ * @param arena     A pointer to the arena.
+ * @param format    printf style format string.
+ *
+ * @return A pointer to the formatted string.
+ */
+char *arena_printf(struct arena *arena, const char *format, ...)
+{
+	va_list ap;
+	char *str;
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	str = arena_alloc(arena, len + 1);
+
+	va_start(ap, format);
+	vsnprintf(str, len + 1, format, ap);
+	va_end(ap);
+
+	return str;
+}
+
+/**
+ * @brief This function is used to release an arena and everything allocated
+ * from it.
+ *
+ * @param arena A pointer to the arena.
+ */
+void arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if (!arena)
+		return;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		g_free(chunk);
+	}
+
+	g_free(arena);
+}
@@ -0,0 +1,920 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks for the GATT server hot paths.
+ *
+ * Built from the same sources as the daemon with bench.c taking the place of
+ * main.c. hrp.c is included directly so the static handlers can be driven
+ * without going through bluetoothd:
+ *
+ *     gcc -O2 -o hrp-bench bench.c hrm.c ring.c arena.c log.c stats.c \
+ *         notifyq.c state.c sensor.c objmgr.c \
+ *         gdbus/mainloop.c gdbus/object.c gdbus/watch.c gdbus/client.c \
+ *         gdbus/polkit.c $(pkg-config --cflags --libs glib-2.0 dbus-1)
+ *
+ * It needs a bus to emit PropertiesChanged on, so run it under a private
+ * daemon:
+ *
+ *     dbus-run-session -- ./hrp-bench [iterations]
+ *
+ * For every case it reports throughput, p50/p99 latency and the number of
+ * malloc/calloc/realloc calls per operation, counted by interposing the
+ * allocator.
+ *
+ *     dbus-run-session -- ./hrp-bench stress SECONDS [CENTRALS]
+ *
+ * drives the method handlers from many simulated centrals at random: reads,
+ * writes, CCC subscribe/unsubscribe, StartNotify/StopNotify, control point
+ * commands, samples and disconnects. Every second it prints throughput, RSS
+ * and the allocations not freed yet, and at the end their growth since the
+ * first second, which stays flat unless a hot path leaks.
+ *
+ *     dbus-run-session -- ./hrp-bench fuzz ITERATIONS [SEED]
+ *
+ * mutates marshalled ReadValue/WriteValue calls and feeds whatever libdbus
+ * accepts to the handlers parsing untrusted input. Built with -DHRP_FUZZER
+ * the same file is a libFuzzer target instead, without the allocator
+ * interposition:
+ *
+ *     clang -g -O1 -fsanitize=fuzzer,address -DHRP_FUZZER -o hrp-fuzz \
+ *         bench.c ... (same sources and flags as above)
+ *     dbus-run-session -- ./hrp-fuzz CORPUS_DIR
+ */
+
+#include "hrp.c"
+
+#define BENCH_DEFAULT_ITERATIONS        100000
+#define BENCH_WARMUP                    1000
+#define STRESS_DEFAULT_CENTRALS         32
+#define STRESS_NOTIFY_INTERVAL          10
+#define FUZZ_MAX_MUTATIONS              4
+
+static atomic_size_t allocs;
+
+/* Allocations not freed yet, grows with a leak */
+static atomic_long live;
+
+#ifndef HRP_FUZZER
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	void *ptr = __libc_malloc(size);
+
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	if (ptr)
+		atomic_fetch_add_explicit(&live, 1, memory_order_relaxed);
+
+	return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __libc_calloc(nmemb, size);
+
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+	if (ptr)
+		atomic_fetch_add_explicit(&live, 1, memory_order_relaxed);
+
+	return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	void *ret = __libc_realloc(ptr, size);
+
+	atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+
+	/* Only NULL in or out changes the number of live blocks */
+	if (!ptr && ret)
+		atomic_fetch_add_explicit(&live, 1, memory_order_relaxed);
+	else if (ptr && !size)
+		atomic_fetch_sub_explicit(&live, 1, memory_order_relaxed);
+
+	return ret;
+}
+
+void free(void *ptr)
+{
+	if (ptr)
+		atomic_fetch_sub_explicit(&live, 1, memory_order_relaxed);
+
+	__libc_free(ptr);
+}
+#endif
+
+/**
+ * @struct bench_ctx
+ * Represents the objects shared by all benchmark cases
+ */
+static struct bench_ctx {
+	DBusConnection *conn;
+	struct hrp *hrp;
+	struct hr_service *hrs;
+	DBusMessage *write_msg;
+	DBusMessage *read_msg;
+	DBusMessage *offset_msg;
+	int notify_peer;
+	unsigned int seq;
+} ctx = {
+	.notify_peer = -1,
+};
+
+static const uint8_t bench_value[20] = {
+	0x10, 0x48, 0x00, 0x03, 0x10, 0x03, 0x20, 0x03, 0x30, 0x03,
+	0x40, 0x03, 0x50, 0x03, 0x60, 0x03, 0x70, 0x03, 0x80, 0x03,
+};
+
+/**
+ * @brief This function is used to dispatch everything queued on the default
+ * main context, which is where gdbus marshals PropertiesChanged.
+ */
+static void bench_dispatch(void)
+{
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	dbus_connection_flush(ctx.conn);
+}
+
+/**
+ * @brief This function is used to build a method call as bluetoothd would
+ * send it on behalf of a device.
+ *
+ * @param method    The method name.
+ * @param device    The object path of the device, NULL for a call without
+ *                  arguments.
+ * @param value     The value to prepend, NULL for none.
+ * @param len       Length of the value.
+ * @param offset    The offset option, left out when 0.
+ *
+ * @return The message.
+ */
+static DBusMessage *bench_call(const char *method, const char *device,
+				const uint8_t *value, int len, uint16_t offset)
+{
+	const char *key_device = "device", *key_mtu = "mtu";
+	const char *key_offset = "offset";
+	dbus_uint16_t mtu = 185;
+	DBusMessageIter iter, dict, entry, variant, array;
+	DBusMessage *msg;
+
+	msg = dbus_message_new_method_call("org.bluez", "/service1",
+						GATT_CHR_IFACE, method);
+	dbus_message_set_serial(msg, 1);
+
+	if (!device)
+		return msg;
+
+	dbus_message_iter_init_append(msg, &iter);
+
+	if (value) {
+		dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "y",
+								&array);
+		dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE,
+							&value, len);
+		dbus_message_iter_close_container(&iter, &array);
+	}
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+	dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL,
+								&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key_device);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "o",
+								&variant);
+	dbus_message_iter_append_basic(&variant, DBUS_TYPE_OBJECT_PATH,
+								&device);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(&dict, &entry);
+
+	dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL,
+								&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key_mtu);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "q",
+								&variant);
+	dbus_message_iter_append_basic(&variant, DBUS_TYPE_UINT16, &mtu);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(&dict, &entry);
+
+	if (offset) {
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+								&key_offset);
+		dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+								"q", &variant);
+		dbus_message_iter_append_basic(&variant, DBUS_TYPE_UINT16,
+								&offset);
+		dbus_message_iter_close_container(&entry, &variant);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return msg;
+}
+
+/**
+ * @brief This function is used to build a method call from the benchmark
+ * device.
+ *
+ * @param method    The method name.
+ * @param value     Whether to prepend a value argument.
+ *
+ * @return The message.
+ */
+static DBusMessage *bench_method_call(const char *method, bool value)
+{
+	return bench_call(method, "/org/bluez/hci0/dev_00_11_22_33_44_55",
+				value ? bench_value : NULL, sizeof(bench_value),
+				0);
+}
+
+/**
+ * @brief This function is used to benchmark chr_write() with the value
+ * emitted as PropertiesChanged.
+ */
+static void bench_chr_write(void)
+{
+	chr_write(ctx.hrs->location, bench_value,
+					sizeof(bench_value), 0);
+	bench_dispatch();
+}
+
+/**
+ * @brief This function is used to benchmark chr_read() into a fresh method
+ * return.
+ */
+static void bench_chr_read(void)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+
+	reply = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	dbus_message_iter_init_append(reply, &iter);
+	chr_read(ctx.hrs->location, &iter);
+	dbus_message_unref(reply);
+}
+
+/**
+ * @brief This function is used to benchmark the ReadValue handler, which
+ * answers from the reply cache.
+ */
+static void bench_read_value(void)
+{
+	DBusMessage *reply;
+
+	reply = chr_read_value(ctx.conn, ctx.read_msg, ctx.hrs->location);
+	dbus_message_unref(reply);
+}
+
+/**
+ * @brief This function is used to start the long write the offset case
+ * continues, so the offset is never past the value. A handler ignoring
+ * the offset option would overwrite the first chunk instead.
+ */
+static void bench_write_offset_setup(void)
+{
+	DBusMessage *reply;
+
+	chr_write(ctx.hrs->location, bench_value,
+					sizeof(bench_value), 0);
+
+	reply = chr_write_value(ctx.conn, ctx.offset_msg, ctx.hrs->location);
+	if (reply)
+		dbus_message_unref(reply);
+
+	bench_dispatch();
+
+	if (ctx.hrs->location->vlen != 2 * sizeof(bench_value)) {
+		fprintf(stderr, "WriteValue ignored the offset option\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * @brief This function is used to benchmark a WriteValue continuing a long
+ * write at an offset, the way bluetoothd forwards Prepare Write chunks.
+ */
+static void bench_write_offset(void)
+{
+	DBusMessage *reply;
+
+	reply = chr_write_value(ctx.conn, ctx.offset_msg, ctx.hrs->location);
+	if (reply)
+		dbus_message_unref(reply);
+
+	bench_dispatch();
+}
+
+/**
+ * @brief This function is used to benchmark parse_value() on a WriteValue
+ * call.
+ */
+static void bench_parse_value(void)
+{
+	DBusMessageIter iter;
+	const uint8_t *value;
+	int len;
+
+	dbus_message_iter_init(ctx.write_msg, &iter);
+	parse_value(&iter, &value, &len);
+}
+
+/**
+ * @brief This function is used to benchmark parse_options() on a WriteValue
+ * call.
+ */
+static void bench_parse_options(void)
+{
+	DBusMessageIter iter;
+	struct attr_options opts = { .device = NULL };
+
+	dbus_message_iter_init(ctx.write_msg, &iter);
+	dbus_message_iter_next(&iter);
+	parse_options(&iter, &opts);
+}
+
+/**
+ * @brief This function is used to benchmark one Heart Rate Measurement
+ * notification sent as PropertiesChanged.
+ */
+static void bench_notify_signal(void)
+{
+	update_heart_rate(ctx.hrp, 0, 60 + (ctx.seq++ & 63), true);
+	queue_rr_interval(ctx.hrp, 0, 800);
+	send_notification(ctx.hrs->msrmt);
+	bench_dispatch();
+}
+
+/**
+ * @brief This function is used to benchmark one Heart Rate Measurement
+ * notification written to an acquired notify socket.
+ */
+static void bench_notify_socket(void)
+{
+	update_heart_rate(ctx.hrp, 0, 60 + (ctx.seq++ & 63), true);
+	queue_rr_interval(ctx.hrp, 0, 800);
+	send_notification(ctx.hrs->msrmt);
+}
+
+/**
+ * @brief This function is used to give the measurement characteristic a
+ * notify socket, as AcquireNotify would.
+ */
+static void bench_notify_socket_setup(void)
+{
+	struct characteristic *chr = ctx.hrs->msrmt;
+
+	chr->notify_io = create_sock_io(&ctx.notify_peer);
+	chr->mtu = 185;
+}
+
+/**
+ * @brief This function is used to read what bluetoothd would have read from
+ * the notify socket.
+ */
+static void bench_notify_socket_drain(void)
+{
+	uint8_t buf[ATT_MAX_VALUE_LEN];
+
+	while (recv(ctx.notify_peer, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+/**
+ * @brief This function is used to release the notify socket again.
+ */
+static void bench_notify_socket_cleanup(void)
+{
+	chr_release_notify_io(ctx.hrs->msrmt);
+	close(ctx.notify_peer);
+	ctx.notify_peer = -1;
+}
+
+/**
+ * @struct bench_case
+ * Represents one benchmark, only run is timed
+ */
+static const struct bench_case {
+	const char *name;
+	void (*setup)(void);
+	void (*run)(void);
+	void (*after)(void);
+	void (*cleanup)(void);
+} bench_cases[] = {
+	{ "chr_write", NULL, bench_chr_write, NULL, NULL },
+	{ "chr_read", NULL, bench_chr_read, NULL, NULL },
+	{ "ReadValue", NULL, bench_read_value, NULL, NULL },
+	{ "WriteValue@off", bench_write_offset_setup, bench_write_offset,
+		NULL, NULL },
+	{ "parse_value", NULL, bench_parse_value, NULL, NULL },
+	{ "parse_options", NULL, bench_parse_options, NULL, NULL },
+	{ "notify_signal", NULL, bench_notify_signal, NULL, NULL },
+	{ "notify_socket", bench_notify_socket_setup, bench_notify_socket,
+		bench_notify_socket_drain, bench_notify_socket_cleanup },
+};
+
+/**
+ * @brief This function is used to compare two latency samples for qsort().
+ *
+ * @param a A pointer to the first sample.
+ * @param b A pointer to the second sample.
+ *
+ * @return <0, 0 or >0 as for qsort().
+ */
+static int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief This function is used to run one benchmark case and print its
+ * results.
+ *
+ * @param bc            A pointer to the benchmark case.
+ * @param samples       Buffer for one latency sample per iteration.
+ * @param iterations    Number of timed iterations.
+ */
+static void bench_run(const struct bench_case *bc, uint64_t *samples,
+						unsigned int iterations)
+{
+	uint64_t total = 0;
+	size_t start_allocs, run_allocs;
+	unsigned int i;
+
+	if (bc->setup)
+		bc->setup();
+
+	for (i = 0; i < BENCH_WARMUP; i++) {
+		bc->run();
+		if (bc->after)
+			bc->after();
+	}
+
+	start_allocs = atomic_load(&allocs);
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = stats_now();
+
+		bc->run();
+		samples[i] = stats_now() - start;
+		total += samples[i];
+
+		if (bc->after)
+			bc->after();
+	}
+
+	/* Allocations made by the untimed hooks are counted as well */
+	run_allocs = atomic_load(&allocs) - start_allocs;
+
+	qsort(samples, iterations, sizeof(*samples), bench_cmp);
+
+	printf("%-14s %12.0f ops/s  p50 %7llu ns  p99 %7llu ns  %6.2f allocs/op\n",
+		bc->name, total ? iterations * 1e9 / total : 0.0,
+		(unsigned long long) samples[iterations / 2],
+		(unsigned long long) samples[(uint64_t) iterations * 99 / 100],
+		(double) run_allocs / iterations);
+
+	if (bc->cleanup)
+		bc->cleanup();
+}
+
+/**
+ * @brief This function is used to read the resident set size.
+ *
+ * @return The RSS in KiB, 0 if unknown.
+ */
+static long bench_rss(void)
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+
+	fclose(f);
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+enum stress_op {
+	STRESS_READ,
+	STRESS_WRITE,
+	STRESS_SUBSCRIBE,
+	STRESS_NOTIFY,
+	STRESS_CTRL_PT,
+	STRESS_SAMPLE,
+	STRESS_DISCONNECT,
+	STRESS_N_OPS
+};
+
+/**
+ * @struct stress_central
+ * Represents one simulated central
+ */
+struct stress_central {
+	char device[64];
+	bool subscribed;
+};
+
+/**
+ * @brief This function is used to run one operation on behalf of a central
+ * and dispatch what it emitted.
+ *
+ * @param c     A pointer to the central.
+ * @param op    The operation.
+ * @param rand  A pointer to the random generator.
+ */
+static void stress_op(struct stress_central *c, enum stress_op op,
+								GRand *rand)
+{
+	static const uint8_t ccc_on[] = { 0x01, 0x00 };
+	static const uint8_t ccc_off[] = { 0x00, 0x00 };
+	static const uint8_t reset[] = { HR_CTRL_PT_RESET_ENERGY };
+	struct characteristic *msrmt = ctx.hrs->msrmt;
+	DBusMessage *msg = NULL, *reply = NULL;
+
+	switch (op) {
+	case STRESS_READ:
+		msg = bench_call("ReadValue", c->device, NULL, 0, 0);
+		reply = chr_read_value(ctx.conn, msg, ctx.hrs->location);
+		break;
+	case STRESS_WRITE:
+		msg = bench_call("WriteValue", c->device, bench_value, 1, 0);
+		reply = chr_write_value(ctx.conn, msg, ctx.hrs->location);
+		break;
+	case STRESS_SUBSCRIBE:
+		msg = bench_call("WriteValue", c->device,
+				c->subscribed ? ccc_off : ccc_on, 2, 0);
+		reply = desc_write_value(ctx.conn, msg, msrmt->desc);
+		c->subscribed = !c->subscribed;
+		break;
+	case STRESS_NOTIFY:
+		if (msrmt->notifying) {
+			msg = bench_call("StopNotify", NULL, NULL, 0, 0);
+			reply = chr_stop_notify(ctx.conn, msg, msrmt);
+		} else {
+			msg = bench_call("StartNotify", NULL, NULL, 0, 0);
+			reply = chr_start_notify(ctx.conn, msg, msrmt);
+		}
+		break;
+	case STRESS_CTRL_PT:
+		msg = bench_call("WriteValue", c->device, reset,
+							sizeof(reset), 0);
+		reply = chr_write_value(ctx.conn, msg, ctx.hrs->ctrl_pt);
+		break;
+	case STRESS_SAMPLE:
+		update_heart_rate(ctx.hrp, 0, g_rand_int_range(rand, 40, 200), true);
+		queue_rr_interval(ctx.hrp, 0, g_rand_int_range(rand, 300, 1500));
+		add_energy_expended(ctx.hrp, 0, 10);
+		break;
+	case STRESS_DISCONNECT:
+		device_disconnected(ctx.hrp, c->device);
+		c->subscribed = false;
+		break;
+	case STRESS_N_OPS:
+		break;
+	}
+
+	if (reply)
+		dbus_message_unref(reply);
+
+	if (msg)
+		dbus_message_unref(msg);
+
+	/* Timers, coalesced signals and the outgoing queue are drained too */
+	bench_dispatch();
+}
+
+/**
+ * @brief This function is used to hammer the handlers from many centrals
+ * for a while, reporting every second.
+ *
+ * @param seconds   How long to run.
+ * @param centrals  Number of simulated centrals.
+ *
+ * @return EXIT_SUCCESS.
+ */
+static int stress_run(unsigned int seconds, unsigned int centrals)
+{
+	struct stress_central *c = g_new0(struct stress_central, centrals);
+	GRand *rand = g_rand_new_with_seed(1);
+	uint64_t start = stats_now(), next = start + 1000000000ULL;
+	uint64_t end = start + seconds * 1000000000ULL;
+	uint64_t ops = 0, last_ops = 0;
+	long base_rss = 0, base_live = 0;
+	unsigned int i, elapsed = 0;
+
+	for (i = 0; i < centrals; i++)
+		snprintf(c[i].device, sizeof(c[i].device),
+				"/org/bluez/hci0/dev_00_00_00_00_%02X_%02X",
+				(i >> 8) & 0xff, i & 0xff);
+
+	printf("%4s %12s %10s %12s\n", "s", "ops/s", "RSS KiB", "live allocs");
+
+	while (stats_now() < end) {
+		stress_op(&c[g_rand_int_range(rand, 0, centrals)],
+				g_rand_int_range(rand, 0, STRESS_N_OPS), rand);
+		ops++;
+
+		if (stats_now() < next)
+			continue;
+
+		next += 1000000000ULL;
+		elapsed++;
+
+		printf("%4u %12llu %10ld %12ld\n", elapsed,
+				(unsigned long long) (ops - last_ops),
+				bench_rss(), atomic_load(&live));
+		last_ops = ops;
+
+		/* The first second grows the tables, growth counts after */
+		if (elapsed == 1) {
+			base_rss = bench_rss();
+			base_live = atomic_load(&live);
+		}
+	}
+
+	for (i = 0; i < centrals; i++)
+		device_disconnected(ctx.hrp, c[i].device);
+
+	stop_notifications(ctx.hrp);
+	bench_dispatch();
+
+	if (elapsed > 1)
+		printf("%llu ops, growth since 1 s: RSS %+ld KiB, "
+				"live allocs %+ld\n", (unsigned long long) ops,
+				bench_rss() - base_rss,
+				atomic_load(&live) - base_live);
+
+	g_rand_free(rand);
+	g_free(c);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This function is used to feed one marshalled message to every
+ * handler parsing untrusted input.
+ *
+ * @param data  The marshalled message.
+ * @param size  Size of the data.
+ *
+ * @return true if libdbus accepted the message.
+ */
+static bool fuzz_one(const uint8_t *data, size_t size)
+{
+	DBusMessage *(*handlers[])(DBusConnection *, DBusMessage *, void *) = {
+		chr_read_value, chr_write_value, chr_write_value,
+		desc_read_value, desc_write_value,
+	};
+	void *targets[] = {
+		ctx.hrs->location, ctx.hrs->location, ctx.hrs->ctrl_pt,
+		ctx.hrs->msrmt->desc, ctx.hrs->msrmt->desc,
+	};
+	DBusMessage *msg;
+	DBusError err;
+	unsigned int i;
+
+	dbus_error_init(&err);
+
+	msg = dbus_message_demarshal((const char *) data, size, &err);
+	if (!msg) {
+		dbus_error_free(&err);
+		return false;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(handlers); i++) {
+		DBusMessage *reply = handlers[i](ctx.conn, msg, targets[i]);
+
+		if (reply)
+			dbus_message_unref(reply);
+	}
+
+	dbus_message_unref(msg);
+
+	/* Every input starts without devices or subscriptions */
+	stop_notifications(ctx.hrp);
+	bench_dispatch();
+
+	return true;
+}
+
+/**
+ * @brief This function is used to fuzz the handlers with randomly mutated
+ * ReadValue/WriteValue calls.
+ *
+ * @param iterations    Number of inputs.
+ * @param seed          Seed of the mutations.
+ *
+ * @return EXIT_SUCCESS.
+ */
+static int fuzz_run(unsigned int iterations, unsigned int seed)
+{
+	static const uint8_t ccc_on[] = { 0x01, 0x00 };
+	DBusMessage *msgs[] = {
+		ctx.read_msg, ctx.write_msg,
+		bench_call("WriteValue", "/org/bluez/hci0/dev_00_11_22_33_44_55",
+							ccc_on, 2, 0),
+	};
+	char *seeds[G_N_ELEMENTS(msgs)];
+	int lens[G_N_ELEMENTS(msgs)];
+	uint8_t buf[1024];
+	GRand *rand = g_rand_new_with_seed(seed);
+	uint64_t start, elapsed;
+	unsigned int i, accepted = 0;
+	long base_live;
+
+	for (i = 0; i < G_N_ELEMENTS(msgs); i++)
+		if (!dbus_message_marshal(msgs[i], &seeds[i], &lens[i]))
+			return EXIT_FAILURE;
+
+	dbus_message_unref(msgs[2]);
+
+	base_live = atomic_load(&live);
+	start = stats_now();
+
+	for (i = 0; i < iterations; i++) {
+		unsigned int n = g_rand_int_range(rand, 0, G_N_ELEMENTS(seeds));
+		size_t len = MIN((size_t) lens[n], sizeof(buf));
+		unsigned int m = g_rand_int_range(rand, 1,
+						FUZZ_MAX_MUTATIONS + 1);
+
+		memcpy(buf, seeds[n], len);
+
+		while (m--)
+			buf[g_rand_int_range(rand, 0, len)] =
+					g_rand_int_range(rand, 0, 256);
+
+		/* Now and then cut the message short */
+		if (!g_rand_int_range(rand, 0, 16))
+			len = g_rand_int_range(rand, 0, len);
+
+		accepted += fuzz_one(buf, len);
+	}
+
+	elapsed = stats_now() - start;
+
+	printf("%u inputs, %u accepted by libdbus, %.0f inputs/s, "
+			"live allocs %+ld\n", iterations, accepted,
+			elapsed ? iterations * 1e9 / elapsed : 0.0,
+			atomic_load(&live) - base_live);
+
+	for (i = 0; i < G_N_ELEMENTS(seeds); i++)
+		dbus_free(seeds[i]);
+
+	g_rand_free(rand);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * @brief This function is used to connect to the bus and create the service
+ * every mode runs against.
+ *
+ * @param notify_interval  Notification interval in ms, 0 for the default.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int bench_setup(unsigned int notify_interval)
+{
+	struct hrp_config config = {
+		.instances = 1,
+		.notify_interval = notify_interval,
+	};
+
+	ctx.conn = g_dbus_setup_private(DBUS_BUS_SESSION, NULL, NULL);
+	if (!ctx.conn) {
+		fprintf(stderr, "No session bus, run under dbus-run-session\n");
+		return -1;
+	}
+
+	ctx.hrp = hrp_new(ctx.conn, &config);
+	if (!ctx.hrp || create_services(ctx.hrp, 1, NULL) != 1) {
+		fprintf(stderr, "Failed to create the service\n");
+		return -1;
+	}
+
+	ctx.hrs = ctx.hrp->instances[0];
+	ctx.write_msg = bench_method_call("WriteValue", true);
+	ctx.read_msg = bench_method_call("ReadValue", false);
+	ctx.offset_msg = bench_call("WriteValue",
+				"/org/bluez/hci0/dev_00_11_22_33_44_55",
+				bench_value, sizeof(bench_value),
+				sizeof(bench_value));
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to release what bench_setup() created.
+ */
+static void bench_teardown(void)
+{
+	dbus_message_unref(ctx.offset_msg);
+	dbus_message_unref(ctx.read_msg);
+	dbus_message_unref(ctx.write_msg);
+
+	hrp_detach(ctx.hrp);
+	bench_dispatch();
+
+	dbus_connection_close(ctx.conn);
+	dbus_connection_unref(ctx.conn);
+}
+
+#ifdef HRP_FUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	if (bench_setup(0))
+		exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	fuzz_one(data, size);
+
+	return 0;
+}
+#else
+int main(int argc, char *argv[])
+{
+	unsigned int iterations = BENCH_DEFAULT_ITERATIONS;
+	uint64_t *samples;
+	unsigned int i;
+	int status;
+
+	if (argc > 2 && !strcmp(argv[1], "stress")) {
+		unsigned int seconds = strtoul(argv[2], NULL, 0);
+		unsigned int centrals = argc > 3 ?
+				strtoul(argv[3], NULL, 0) :
+				STRESS_DEFAULT_CENTRALS;
+
+		if (!seconds || !centrals) {
+			fprintf(stderr, "Usage: %s stress SECONDS [CENTRALS]\n",
+								argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		if (bench_setup(STRESS_NOTIFY_INTERVAL))
+			return EXIT_FAILURE;
+
+		status = stress_run(seconds, centrals);
+		bench_teardown();
+
+		return status;
+	}
+
+	if (argc > 2 && !strcmp(argv[1], "fuzz")) {
+		iterations = strtoul(argv[2], NULL, 0);
+
+		if (!iterations) {
+			fprintf(stderr, "Usage: %s fuzz ITERATIONS [SEED]\n",
+								argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		if (bench_setup(0))
+			return EXIT_FAILURE;
+
+		status = fuzz_run(iterations, argc > 3 ?
+					strtoul(argv[3], NULL, 0) : 1);
+		bench_teardown();
+
+		return status;
+	}
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	if (!iterations) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (bench_setup(0))
+		return EXIT_FAILURE;
+
+	samples = g_new(uint64_t, iterations);
+
+	for (i = 0; i < G_N_ELEMENTS(bench_cases); i++)
+		bench_run(&bench_cases[i], samples, iterations);
+
+	g_free(samples);
+
+	bench_teardown();
+
+	return EXIT_SUCCESS;
+}
+#endif
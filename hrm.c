@@ -0,0 +1,96 @@
+/**
+ * @file hrm.c
+ * @brief Heart Rate Measurement encoder.
+ *
+ * Builds the 0x2A37 characteristic value from the sensor state straight into
+ * a caller provided buffer, packing as many RR-intervals as the buffer allows.
+ */
+
+#include "hrp.h"
+
+/**
+ * @brief This function is used to queue an RR-interval, dropping the oldest
+ * one when the queue is full.
+ *
+ * @param state A pointer to the sensor state.
+ * @param rr    The RR-interval in units of 1/1024 second.
+ */
+void hrm_queue_rr(struct hrm_state *state, uint16_t rr)
+{
+	unsigned int tail;
+
+	if (state->rr_count == HRM_RR_QUEUE_LEN) {
+		state->rr_head = (state->rr_head + 1) % HRM_RR_QUEUE_LEN;
+		state->rr_count--;
+	}
+
+	tail = (state->rr_head + state->rr_count) % HRM_RR_QUEUE_LEN;
+	state->rr[tail] = rr;
+	state->rr_count++;
+}
+
+/**
+ * @brief This function is used to store a little endian 16 bit value.
+ *
+ * @param buf   A pointer to the destination.
+ * @param val   The value to be stored.
+ */
+static inline void put_le16(uint8_t *buf, uint16_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = val >> 8;
+}
+
+/**
+ * @brief This function is used to encode a Heart Rate Measurement value.
+ *
+ * @param state A pointer to the sensor state.
+ * @param buf   The buffer to encode into.
+ * @param size  Size of the buffer.
+ *
+ * @return The encoded length or -ENOSPC if not even the heart rate fits.
+ */
+int hrm_encode(struct hrm_state *state, uint8_t *buf, size_t size)
+{
+	uint8_t flags = 0;
+	size_t len = 1;
+
+	if (state->hr > UINT8_MAX)
+		flags |= HRM_FLAG_HR_UINT16;
+
+	if (state->contact_supported) {
+		flags |= HRM_FLAG_CONTACT_SUPPORTED;
+		if (state->contact)
+			flags |= HRM_FLAG_CONTACT_DETECTED;
+	}
+
+	if (size < len + (flags & HRM_FLAG_HR_UINT16 ? 2 : 1))
+		return -ENOSPC;
+
+	if (flags & HRM_FLAG_HR_UINT16) {
+		put_le16(buf + len, state->hr);
+		len += 2;
+	} else
+		buf[len++] = state->hr;
+
+	if (state->energy_present && size >= len + 2) {
+		flags |= HRM_FLAG_ENERGY_EXPENDED;
+		put_le16(buf + len, state->energy);
+		len += 2;
+	}
+
+	if (state->rr_count && size >= len + 2)
+		flags |= HRM_FLAG_RR_INTERVAL;
+
+	while (state->rr_count && size >= len + 2) {
+		put_le16(buf + len, state->rr[state->rr_head]);
+		len += 2;
+
+		state->rr_head = (state->rr_head + 1) % HRM_RR_QUEUE_LEN;
+		state->rr_count--;
+	}
+
+	buf[0] = flags;
+
+	return len;
+}
@@ -10,668 +10,3178 @@
 
 #include "hrp.h"
 
+/*
+ * Heart Rate measurement support notification only. Supported
+ * properties are defined at doc/gatt-api.txt. See "Flags"
+ * property of the GattCharacteristic1.
+ */
+static const char *hrs_hr_msrmt_props[] = { "notify", NULL };
+static const char *hrs_body_sensor_loc_props[] = { "read", NULL };
+static const char *hrs_hr_ctrl_pt_props[] = { "write", NULL };
+static const char *hrs_hr_ctrl_pt_wwr_props[] = { "write",
+					"write-without-response", NULL };
+static const char *ccc_desc_props[] = { "read", "write", NULL };
+static const char *battery_level_props[] = { "read", "notify", NULL };
+static const char *device_info_props[] = { "read", NULL };
+
 /**
- * @brief This function is used asa callback to retrieve the UUID property value
- * of the descriptor.
- *
- * @param property  A pointer to the GDBusPropertyTable structure.
- * @param iter      A pointer to DBusMessageIter structure.
- * @param user_data A pointer to user defined data.
- *
- * @return TRUE indicates the property value retrieval was successful.
+ * @struct hrp
+ * Represents the server attached to the host's connection, everything the
+ * services share lives here
  */
-static gboolean desc_get_uuid(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
-{
-	struct descriptor *desc = user_data;
+struct hrp {
+	DBusConnection *conn;
+	GDBusClient *client;
+	struct object_manager *om;
+	struct hrp_state *state;
+	char *adapter;
+	uint64_t started;
 
-	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &desc->uuid);
+	/* When the pending RegisterApplication was sent, see stats_now() */
+	uint64_t register_app_start;
 
-	return TRUE;
-}
+	/* Heart Rate Service instances, indexed by instance number */
+	struct hr_service **instances;
+	unsigned int n_instances;
+
+	/* Characteristics currently in notifying state */
+	GSList *notifying;
+
+	/* Period of the notification timer in milliseconds */
+	unsigned int notify_interval;
+
+	/* Adaptive notification rate, see struct hrp_config */
+	bool adaptive_enabled;
+	unsigned int adaptive_delta;
+	unsigned int adaptive_keepalive;
+
+	/* Queue notifications wait in while the notify socket is busy */
+	unsigned int notify_queue_len;
+	enum notify_policy notify_queue_policy;
+	unsigned int notify_queue_high_water;
+
+	/* Told when instances become congested or recover */
+	congestion_func_t congestion_func;
+	void *congestion_data;
+
+	/* PropertiesChanged coalescing, see struct hrp_config */
+	bool coalesce_enabled;
+	unsigned int coalesce_window;
+
+	/* Registered data sinks, NULL when nobody listens */
+	GSList *sinks;
+
+	/* The WriteValue call being handled, written values point into its body */
+	DBusMessage *write_msg;
+
+	/* The message the value handed to the running sink points into */
+	DBusMessage *sink_msg;
+
+	/* Known devices keyed by their object path, the key is dev->path */
+	GHashTable *devices;
+
+	/* Set while a batch of samples is applied, notified once at the end */
+	bool applying_samples;
+};
 
 /**
- * @brief This function is used as a callback to retrieve the characteristic
- * property value of a descriptor.
+ * @brief This function is used to look up a service instance by number.
  *
- * @param property  A pointer to the GDBusPropertyTable structure.
- * @param iter      A pointer to DBusMessageIter structure.
- * @param user_data A pointer to user defined data.
- * 
- * @return TRUE indicates the property value retrieval was successful.
+ * @param hrp   A pointer to the context.
+ * @param index The instance number.
+ *
+ * @return A pointer to the service instance or NULL.
  */
-static gboolean desc_get_characteristic(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+static struct hr_service *find_hr_service(struct hrp *hrp, unsigned int index)
 {
-	struct descriptor *desc = user_data;
-
-	dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH,
-						&desc->chr->path);
+	if (index >= hrp->n_instances)
+		return NULL;
 
-	return TRUE;
+	return hrp->instances[index];
 }
 
+/* Flags a characteristic can have, the index is the bit in chr->flags */
+static const char *known_props[] = {
+	"broadcast", "read", "write-without-response", "write", "notify",
+	"indicate", "authenticated-signed-writes", "reliable-write",
+	"writable-auxiliaries", NULL
+};
+
+#define PROP_READ               (1U << 1)
+#define PROP_WRITE_WITHOUT_RESP (1U << 2)
+#define PROP_WRITE              (1U << 3)
+#define PROP_NOTIFY             (1U << 4)
+#define PROP_INDICATE           (1U << 5)
+
 /**
- * @brief This function is responsible for reading the value of a descriptor and
- * appending it to a D-Bus message iterator.
+ * @brief This function is used to intern a UUID, so that UUIDs can be
+ * compared by pointer and every attribute shares one copy of the string.
+ * UUIDs are lower-cased first since their comparison is case insensitive.
  *
- * @param desc  A pointer to the descriptor structure.
- * @param iter  A pointer to DBusMessageIter structure.
+ * @param uuid  A string representing the UUID.
  *
- * @return true indicates the read operation was successful.
+ * @return The canonical copy of the UUID.
  */
-static bool desc_read(struct descriptor *desc, DBusMessageIter *iter)
+static const char *intern_uuid(const char *uuid)
 {
-	DBusMessageIter array;
+	char buf[64];
+	size_t i;
 
-	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
-					DBUS_TYPE_BYTE_AS_STRING, &array);
+	for (i = 0; uuid[i] && i < sizeof(buf) - 1; i++)
+		buf[i] = g_ascii_tolower(uuid[i]);
 
-	if (desc->vlen && desc->value)
-		dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE,
-						&desc->value, desc->vlen);
+	if (uuid[i])
+		return g_intern_string(uuid);
 
-	dbus_message_iter_close_container(iter, &array);
+	buf[i] = '\0';
 
-	return true;
+	return g_intern_string(buf);
 }
 
 /**
- * @brief This function is used as a callback to handle property access request
- * for the Value property of a descriptor.
+ * @brief This function is used to map a characteristic flag to its bit.
  *
- * @param property  A pointer to GDBusPropertyTable structure.
- * @param iter      A pointer to DBusMessageIter structure.
- * @param user_data A pointer to the user defined data.
+ * @param flag  A string representing the flag, e.g. "notify".
  *
- * @return This function returns the result of desc_read function which is a
- * boolean value indicating the success of the read operation.
+ * @return The bit of the flag, 0 if it is unknown.
  */
-static gboolean desc_get_value(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+static unsigned int prop_mask(const char *flag)
 {
-	struct descriptor *desc = user_data;
+	unsigned int i;
 
-	printf("Descriptor(%s): Get(\"Value\")\n", desc->uuid);
+	for (i = 0; known_props[i]; i++)
+		if (!strcmp(known_props[i], flag))
+			return 1U << i;
 
-	return desc_read(desc, iter);
+	return 0;
 }
 
 /**
- * @brief This function is used to handle the writing of a value to a descriptor.
+ * @brief This function is used to turn a flags array into a bit mask once at
+ * registration time.
  *
- * @param connection    A pointer to DBusConnection.
- * @param desc          A pointer to the descriptor structure.
- * @param value         A pointer to the buffer containing the value to be written.
- * @param len           Length of the value buffer.
+ * @param props A pointer to array of strings.
  *
+ * @return The bit mask of all known flags.
  */
-static void desc_write(DBusConnection *connection, struct descriptor *desc, const uint8_t *value, int len)
+static unsigned int props_to_mask(const char **props)
 {
-	free(desc->value);
-	desc->value = util_memdup(value, len);
-	desc->vlen = len;
+	unsigned int mask = 0;
+	int i;
 
-	callback(desc->value, desc->vlen);
+	for (i = 0; props[i]; i++)
+		mask |= prop_mask(props[i]);
 
-	g_dbus_emit_property_changed(connection, desc->path,
-					GATT_DESCRIPTOR_IFACE, "Value");
+	return mask;
 }
 
+/* Attributes for which only the latest value is of interest */
+static const char *coalesce_uuids[] = {
+	BODY_SENSOR_LOC_CHR_UUID,
+	CLIENT_CHR_CONFIG_DESCRIPTOR_UUID,
+	NULL
+};
+
 /**
- * @brief This function is used to parse a value from D-Bus message iterator and
- * retrieve the value and length of an array.
+ * @brief This function is used to decide whether PropertiesChanged of an
+ * attribute is coalesced.
  *
- * @param iter  A pointer to DBusMessageIter structure.
- * @param value A pointer to a pointer that will upated with the address of value array.
- * @param len   A pointer to an integer that will update with the length of value array.
+ * @param hrp   A pointer to the context.
+ * @param uuid  A string representing the interned UUID of the attribute.
  *
- * @return 0 indicates the successful parsing the value.
+ * @return true if coalescing is enabled and applies to the UUID.
  */
-static int parse_value(DBusMessageIter *iter, const uint8_t **value, int *len)
+static bool uuid_coalesces(struct hrp *hrp, const char *uuid)
 {
-	DBusMessageIter array;
+	int i;
 
-	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
-		return -EINVAL;
+	if (!hrp->coalesce_enabled)
+		return false;
 
-	dbus_message_iter_recurse(iter, &array);
-	dbus_message_iter_get_fixed_array(&array, value, len);
+	for (i = 0; coalesce_uuids[i]; i++)
+		if (intern_uuid(coalesce_uuids[i]) == uuid)
+			return true;
 
-	return 0;
+	return false;
 }
 
 /**
- * @brief This function is used to handle property setting request for Value
- * property of a descriptor.
+ * @brief This function is used to schedule a coalesced PropertiesChanged.
  *
- * @param property  A pointer to GDBusPropertyTable structure.
- * @param iter      A pointer to DBusMessageIter structure.
- * @param id        The identifier of the pending property set operation.
- * @param user_data A pointer to the user defined data.
+ * @param hrp   A pointer to the context.
+ * @param func  The function emitting the signal.
+ * @param data  A pointer to the attribute.
+ *
+ * @return The source id.
  */
-static void desc_set_value(const GDBusPropertyTable *property,
-				DBusMessageIter *iter,
-				GDBusPendingPropertySet id, void *user_data)
+static guint schedule_flush(struct hrp *hrp, GSourceFunc func, void *data)
 {
-	struct descriptor *desc = user_data;
-	const uint8_t *value;
-	int len;
-
-	printf("Descriptor(%s): Set(\"Value\", ...)\n", desc->uuid);
-
-	if (parse_value(iter, &value, &len)) {
-		printf("Invalid value for Set('Value'...)\n");
-		g_dbus_pending_property_error(id,
-					"error" ".InvalidArguments",
-					"Invalid arguments in method call");
-		return;
-	}
-
-	desc_write(NULL, desc, value, len);
+	if (hrp->coalesce_window)
+		return g_timeout_add(hrp->coalesce_window, func, data);
 
-	g_dbus_pending_property_success(id);
+	return g_idle_add(func, data);
 }
 
 /**
- * @brief This function is used to retrieve the properties of a descriptor.
+ * @struct sink
+ * Represents a data sink registered for a characteristic or descriptor UUID
+ */
+struct sink {
+	const char *uuid;
+	sink_func_t func;
+	void *user_data;
+};
+
+/**
+ * @brief This function is used to look up the data sink registered for a UUID.
  *
- * @param property  A pointer to the GDBusPropertyTable structure.
- * @param iter      A pointer to the DBusMessageIter structure.
- * @param data      A pointer to the user defined data.
+ * @param hrp   A pointer to the context.
+ * @param uuid  A string representing the interned UUID.
  *
- * @return TRUE indicating the property retrieval was successful.
+ * @return A pointer to the sink or NULL if there is none.
  */
-static gboolean desc_get_props(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *data)
+static struct sink *find_sink(struct hrp *hrp, const char *uuid)
 {
-	struct descriptor *desc = data;
-	DBusMessageIter array;
-	int i;
-
-	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
-					DBUS_TYPE_STRING_AS_STRING, &array);
+	GSList *l;
 
-	for (i = 0; desc->props[i]; i++)
-		dbus_message_iter_append_basic(&array,
-					DBUS_TYPE_STRING, &desc->props[i]);
+	for (l = hrp->sinks; l; l = l->next) {
+		struct sink *sink = l->data;
 
-	dbus_message_iter_close_container(iter, &array);
+		if (sink->uuid == uuid)
+			return sink;
+	}
 
-	return TRUE;
+	return NULL;
 }
 
 /**
- * @brief An array called desc_properties of type GDBusPropertyTable.
+ * @brief This function is used to hand a new value to the data sink registered
+ * for the attribute, if any.
+ *
+ * @param hrp   A pointer to the context.
+ * @param uuid  A string representing the interned UUID of the attribute.
+ * @param value A pointer to the value, only valid for the duration of the call.
+ * @param len   Length of the value.
+ * @param msg   The message the value points into, NULL if it does not.
  */
-static const GDBusPropertyTable desc_properties[] = {
-	{ "UUID",		"s", desc_get_uuid },
-	{ "Characteristic",	"o", desc_get_characteristic },
-	{ "Value",		"ay", desc_get_value, desc_set_value, NULL },
-	{ "Flags",		"as", desc_get_props, NULL, NULL },
-	{ }
-};
+static void sink_dispatch(struct hrp *hrp, const char *uuid,
+				const uint8_t *value, int len, DBusMessage *msg)
+{
+	struct sink *sink;
+
+	if (!hrp->sinks)
+		return;
+
+	sink = find_sink(hrp, uuid);
+	if (!sink)
+		return;
+
+	hrp->sink_msg = msg;
+	sink->func(uuid, value, len, sink->user_data);
+	hrp->sink_msg = NULL;
+}
 
 /**
- * @brief This function is a callback to retrieve the UUID property value of a 
- * characteristic.
+ * @brief This function is used by a sink to keep the value it was handed
+ * without copying it.
  *
- * @param property  A pointer to GDBusPropertyTable structure.
- * @param iter      A pointer to DBusMessageIter structure.
- * @param user_data A pointer to user defined data.
+ * @param hrp   A pointer to the context.
  *
- * @return TRUE indicate the property value retrieval was successful.
+ * @return A new reference to the message the value points into or NULL if
+ * the value has to be copied.
  */
-static gboolean chr_get_uuid(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+DBusMessage *sink_ref_message(struct hrp *hrp)
 {
-	struct characteristic *chr = user_data;
-
-	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &chr->uuid);
-
-	return TRUE;
+	return hrp->sink_msg ? dbus_message_ref(hrp->sink_msg) : NULL;
 }
 
 /**
- * @brief This function is used as a callback to retrieve the Service property
- * value of a characteristic.
+ * @brief This function is used to register a data sink for a UUID, replacing
+ * any sink previously registered for it.
  *
- * @param property  A pointer to GDBusPropertyTable structure.
- * @param iter      A pointer to DBusMessageIter structure.
- * @param user_data A pointer to user defined data. 
+ * @param hrp       A pointer to the context.
+ * @param uuid      A string representing the characteristic or descriptor UUID.
+ * @param func      The function called with every new value.
+ * @param user_data A pointer to user defined data passed to func.
  *
- * @return TRUE indicate the property value retrieval was successful.
+ * @return 0 on success, -EINVAL on invalid arguments.
  */
-static gboolean chr_get_service(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+int register_sink(struct hrp *hrp, const char *uuid, sink_func_t func,
+							void *user_data)
 {
-	struct characteristic *chr = user_data;
+	struct sink *sink;
 
-	dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH,
-							&chr->service);
+	if (!uuid || !func)
+		return -EINVAL;
 
-	return TRUE;
+	uuid = intern_uuid(uuid);
+
+	sink = find_sink(hrp, uuid);
+	if (!sink) {
+		sink = g_new0(struct sink, 1);
+		sink->uuid = uuid;
+		hrp->sinks = g_slist_prepend(hrp->sinks, sink);
+	}
+
+	sink->func = func;
+	sink->user_data = user_data;
+
+	return 0;
 }
 
 /**
- * @brief This function is responsible for reading the value of a characteristic
- * and appending it to a D-Bus message iterator.
+ * @brief This function is used to remove the data sink registered for a UUID.
  *
- * @param chr   A pointer to characteristic structure.
- * @param iter  A pointer to DBusMessageIter structure.
- * @return true indicates the read operation was successful.
+ * @param hrp   A pointer to the context.
+ * @param uuid  A string representing the characteristic or descriptor UUID.
  */
-static bool chr_read(struct characteristic *chr, DBusMessageIter *iter)
+void unregister_sink(struct hrp *hrp, const char *uuid)
 {
-	DBusMessageIter array;
-
-	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
-					DBUS_TYPE_BYTE_AS_STRING, &array);
+	struct sink *sink;
 
-	dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE,
-						&chr->value, chr->vlen);
+	if (!uuid)
+		return;
 
-	dbus_message_iter_close_container(iter, &array);
+	sink = find_sink(hrp, intern_uuid(uuid));
+	if (!sink)
+		return;
 
-	return true;
+	hrp->sinks = g_slist_remove(hrp->sinks, sink);
+	g_free(sink);
 }
 
 /**
- * @brief This function is used as a callback to handle property access request
- * for the Value property of a characteristic.
+ * @struct hrp_device
+ * Represents a central seen in the "device" option of a request
+ */
+struct hrp_device {
+	char *path;
+	uint16_t mtu;
+	GSList *subscribed;
+	bool provisional;
+};
+
+/**
+ * @brief This function is used to free a device entry.
  *
- * @param property  A pointer to GDBusPropertyTable structure.                  
- * @param iter      A pointer to DBusMessageIter structure.                 
- * @param user_data A pointer to user defined data.                         
- *                                                                              
- * @return This function will returns the result of the chr_read function.
+ * @param data  A pointer to the device.
  */
-static gboolean chr_get_value(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+static void device_free(gpointer data)
 {
-	struct characteristic *chr = user_data;
-
-	printf("Characteristic(%s): Get(\"Value\")\n", chr->uuid);
+	struct hrp_device *dev = data;
 
-	return chr_read(chr, iter);
+	g_slist_free(dev->subscribed);
+	g_free(dev);
 }
 
 /**
- * @brief This function is used to retrieve the properties of a characteristic.
+ * @brief This function is used to look up a device, optionally creating it.
  *
- * @param property  A pointer to GDBusPropertyTable structure.                  
- * @param iter      A pointer to DBusMessageIter structure.                 
- * @param user_data A pointer to user defined data.                         
- *                                                                              
- * @return TRUE indicate the property value retrieval was successful.       
+ * @param hrp       A pointer to the context.
+ * @param path      The object path of the device.
+ * @param create    Whether to create a missing entry.
+ *
+ * @return A pointer to the device or NULL.
  */
-static gboolean chr_get_props(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *data)
+static struct hrp_device *device_lookup(struct hrp *hrp, const char *path,
+								bool create)
 {
-	struct characteristic *chr = data;
-	DBusMessageIter array;
-	int i;
+	struct hrp_device *dev;
 
-	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
-					DBUS_TYPE_STRING_AS_STRING, &array);
+	if (!path)
+		return NULL;
 
-	for (i = 0; chr->props[i]; i++)
-		dbus_message_iter_append_basic(&array,
-					DBUS_TYPE_STRING, &chr->props[i]);
+	if (!hrp->devices) {
+		if (!create)
+			return NULL;
 
-	dbus_message_iter_close_container(iter, &array);
+		/* Paths come from requests, they must go with the device */
+		hrp->devices = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, device_free);
+	}
 
-	return TRUE;
+	dev = g_hash_table_lookup(hrp->devices, path);
+	if (dev || !create)
+		return dev;
+
+	dev = g_new0(struct hrp_device, 1);
+	dev->path = g_strdup(path);
+	dev->mtu = ATT_DEFAULT_LE_MTU;
+	g_hash_table_insert(hrp->devices, dev->path, dev);
+
+	hrp_debug("Device %s: added", path);
+
+	return dev;
 }
 
-/**                                                                             
- * @brief This function is used to handle the writing of a value to a characteristic.
- *                                                                              
- * @param connection    A pointer to DBusConnection.                            
- * @param chr           A pointer to the characteristic structure.                  
- * @param value         A pointer to the buffer containing the value to be written.
- * @param len           Length of the value buffer.                             
- *                                                                              
+/**
+ * @brief This function is used to find the state file entry of a device,
+ * optionally taking a free one.
+ *
+ * @param hrp       A pointer to the context.
+ * @param path      The object path of the device.
+ * @param create    Whether to take a free entry if there is none yet.
+ *
+ * @return A pointer to the entry or NULL if there is no state file, no free
+ * entry or the path does not fit.
  */
-static void chr_write(DBusConnection *connection, struct characteristic *chr, const uint8_t *value, int len)
+static struct hrp_state_device *state_device(struct hrp *hrp,
+						const char *path, bool create)
 {
-	free(chr->value);
-	chr->value = util_memdup(value, len);
-	chr->vlen = len;
+	struct hrp_state *state = hrp->state;
+	struct hrp_state_device *free_sd = NULL;
+	unsigned int i;
 
-	callback(chr->value, chr->vlen);
+	if (!state || strlen(path) >= HRP_STATE_PATH_LEN)
+		return NULL;
 
-	g_dbus_emit_property_changed(connection, chr->path, GATT_CHR_IFACE,
-								"Value");
-}
+	for (i = 0; i < HRP_STATE_DEVICES; i++) {
+		struct hrp_state_device *sd = &state->devices[i];
 
-/**                                                                             
- * @brief This function is used to handle property setting request for Value    
- * property of a characteristic.                                                    
- *                                                                              
- * @param property  A pointer to GDBusPropertyTable structure.                  
- * @param iter      A pointer to DBusMessageIter structure.                     
- * @param id        The identifier of the pending property set operation.       
- * @param user_data A pointer to the user defined data.                         
- */                
-static void chr_set_value(const GDBusPropertyTable *property,
-				DBusMessageIter *iter,
-				GDBusPendingPropertySet id, void *user_data)
-{
-	struct characteristic *chr = user_data;
-	const uint8_t *value;
-	int len;
-
-	printf("Characteristic(%s): Set('Value', ...)\n", chr->uuid);
+		if (!sd->path[0]) {
+			if (!free_sd)
+				free_sd = sd;
+			continue;
+		}
 
-	if (!parse_value(iter, &value, &len)) {
-		printf("Invalid value for Set('Value'...)\n");
-		g_dbus_pending_property_error(id,
-					"ERROR_INTERFACE" ".InvalidArguments",
-					"Invalid arguments in method call");
-		return;
+		if (!strcmp(sd->path, path))
+			return sd;
 	}
 
-	chr_write(NULL, chr, value, len);
+	if (!create || !free_sd)
+		return NULL;
 
-	g_dbus_pending_property_success(id);
-}
+	strcpy(free_sd->path, path);
+	free_sd->mtu = ATT_DEFAULT_LE_MTU;
+	memset(free_sd->ccc, 0, sizeof(free_sd->ccc));
 
-/**
- * @brief An array called chr_properties of type GDBusPropertyTable.  
- */
-static const GDBusPropertyTable chr_properties[] = {
-	{ "UUID",	"s", chr_get_uuid },
-	{ "Service",	"o", chr_get_service },
-	{ "Value",	"ay", chr_get_value, chr_set_value, NULL },
-	{ "Flags",	"as", chr_get_props, NULL, NULL },
-	{ }
-};
+	return free_sd;
+}
 
 /**
- * @brief This function is used as a callback to handle property access request
- * for Primary property of a service.
+ * @brief This function is used to record a CCC change of a device in the
+ * state file.
  *
- * @param property  A pointer to GDBusPropertyTable structure.                  
- * @param iter      A pointer to DBusMessageIter structure.                 
- * @param user_data A pointer to user defined data.                         
- *                                                                              
- * @return TRUE indicate the property value retrieval was successful.                     
+ * The entry is released once the device has no subscription left.
+ *
+ * @param dev       A pointer to the device.
+ * @param chr       A pointer to the characteristic.
+ * @param enable    Whether the device is subscribed now.
  */
-static gboolean service_get_primary(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+static void state_save_ccc(struct hrp_device *dev, struct characteristic *chr,
+								bool enable)
 {
-	dbus_bool_t primary = TRUE;
+	struct hrp *hrp = chr->hrs->hrp;
+	struct hrp_state_device *sd;
+	unsigned int i;
+
+	if (chr->hrs->index >= HRP_STATE_INSTANCES)
+		return;
 
-	printf("Get Primary: %s\n", primary ? "True" : "False");
+	sd = state_device(hrp, dev->path, enable);
+	if (!sd)
+		return;
 
-	dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &primary);
+	if (enable) {
+		sd->ccc[chr->hrs->index] |= 1 << chr->index;
+		sd->mtu = dev->mtu;
+	} else
+		sd->ccc[chr->hrs->index] &= ~(1 << chr->index);
 
-	return TRUE;
+	for (i = 0; i < HRP_STATE_INSTANCES; i++)
+		if (sd->ccc[i])
+			break;
+
+	if (i == HRP_STATE_INSTANCES)
+		sd->path[0] = '\0';
+
+	state_sync(hrp->state);
 }
 
 /**
- * @brief This function is used as a callback to handle property access request 
- * for UUID property of a service. 
+ * @brief This function is used to drop a device from the state file.
  *
- * @param property  A pointer to GDBusPropertyTable structure.                  
- * @param iter      A pointer to DBusMessageIter structure.                     
- * @param user_data A pointer to user defined data.                             
- *                                                                              
- * @return TRUE indicate the property value retrieval was successful.
+ * @param hrp   A pointer to the context.
+ * @param path  The object path of the device.
  */
-static gboolean service_get_uuid(const GDBusPropertyTable *property,
-					DBusMessageIter *iter, void *user_data)
+static void state_forget_device(struct hrp *hrp, const char *path)
 {
-	const char *uuid = user_data;
+	struct hrp_state_device *sd = state_device(hrp, path, false);
 
-	printf("Get UUID: %s\n", uuid);
-
-	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &uuid);
+	if (!sd)
+		return;
 
-	return TRUE;
+	sd->path[0] = '\0';
+	state_sync(hrp->state);
 }
 
-/**                                                                             
- * @brief An array called service_properties of type GDBusPropertyTable.            
- */
-static const GDBusPropertyTable service_properties[] = {
-	{ "Primary", "b", service_get_primary },
-	{ "UUID", "s", service_get_uuid },
-	{ "Includes", "ao",},
-	{ }
-};
-
 /**
- * @brief This function is used as a callback to handle the distraction of a
- * GATT characteristic interface.
+ * @brief This function is used to get the state file entry of an instance.
  *
- * @param user_data A pointer to user defined data associated with chr interface.
+ * @param hrs   A pointer to the service instance.
  *
+ * @return A pointer to the entry or NULL if there is no state file.
  */
-static void chr_iface_destroy(gpointer user_data)
+static struct hrp_state_instance *state_instance(struct hr_service *hrs)
 {
-	struct characteristic *chr = user_data;
+	struct hrp_state *state = hrs->hrp->state;
+
+	if (!state || hrs->index >= HRP_STATE_INSTANCES)
+		return NULL;
 
-	g_free(chr->uuid);
-	g_free(chr->service);
-	free(chr->value);
-	g_free(chr->path);
-	g_free(chr);
+	return &state->instances[hrs->index];
 }
 
 /**
- * @brief This function is used as a callback to handle the distraction of a 
- * descriptor interface
+ * @brief This function is used to record the Body Sensor Location of an
+ * instance in the state file.
  *
- * @param user_data A pointer to user defined data associated with desc interface.
+ * @param chr   A pointer to the Body Sensor Location characteristic.
  */
-static void desc_iface_destroy(gpointer user_data)
+static void state_save_location(struct characteristic *chr)
 {
-	struct descriptor *desc = user_data;
+	struct hrp_state_instance *si = state_instance(chr->hrs);
 
-	g_free(desc->uuid);
-	free(desc->value);
-	g_free(desc->path);
-	g_free(desc);
+	if (!si || chr->vlen < 1)
+		return;
+
+	si->valid |= HRP_STATE_LOCATION;
+	si->location = chr->value[0];
+	state_sync(chr->hrs->hrp->state);
 }
 
 /**
- * @brief This function is used to parse options from D-Bus message iterator.
- *
- * @param iter      A pointer to DBusMessageIter structure.
- * @param device    A pointer to a pointer to a string representing the device option.
+ * @brief This function is used to recompute the MTU notifications of a
+ * characteristic are encoded for, the smallest one of its subscribers.
  *
- * @return 0 indicates the successful parsing.
+ * @param chr   A pointer to the characteristic structure.
  */
-static int parse_options(DBusMessageIter *iter, const char **device)
+static void chr_update_sub_mtu(struct characteristic *chr)
 {
-	DBusMessageIter dict;
+	GHashTable *devices = chr->hrs->hrp->devices;
+	GHashTableIter iter;
+	gpointer value;
+	uint16_t mtu = 0;
 
-	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
-		return -EINVAL;
+	if (!chr->subscribers || !devices) {
+		chr->sub_mtu = 0;
+		return;
+	}
 
-	dbus_message_iter_recurse(iter, &dict);
+	g_hash_table_iter_init(&iter, devices);
 
-	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
-		const char *key;
-		DBusMessageIter value, entry;
-		int var;
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct hrp_device *dev = value;
 
-		dbus_message_iter_recurse(&dict, &entry);
-		dbus_message_iter_get_basic(&entry, &key);
+		if (!g_slist_find(dev->subscribed, chr))
+			continue;
 
-		dbus_message_iter_next(&entry);
-		dbus_message_iter_recurse(&entry, &value);
+		if (!mtu || dev->mtu < mtu)
+			mtu = dev->mtu;
+	}
 
-		var = dbus_message_iter_get_arg_type(&value);
-		if (strcasecmp(key, "device") == 0) {
-			if (var != DBUS_TYPE_OBJECT_PATH)
-				return -EINVAL;
-			dbus_message_iter_get_basic(&value, device);
-			printf("Device: %s\n", *device);
-		}
+	chr->sub_mtu = mtu;
+}
 
-		dbus_message_iter_next(&dict);
+/**
+ * @brief This function is used to record the device and MTU a request
+ * came from.
+ *
+ * @param hrp   A pointer to the context.
+ * @param path  The object path of the device, may be NULL.
+ * @param mtu   The MTU from the options, 0 if not given.
+ */
+static void device_seen(struct hrp *hrp, const char *path, uint16_t mtu)
+{
+	struct hrp_device *dev = device_lookup(hrp, path, true);
+	struct hrp_state_device *sd;
+	GSList *l;
+
+	if (!dev || !mtu || mtu == dev->mtu)
+		return;
+
+	dev->mtu = mtu;
+
+	sd = state_device(hrp, dev->path, false);
+	if (sd) {
+		sd->mtu = mtu;
+		state_sync(hrp->state);
 	}
 
-	return 0;
+	for (l = dev->subscribed; l; l = l->next)
+		chr_update_sub_mtu(l->data);
 }
 
 /**
- * @brief This function is used to handle D-Bus method call for reading
- * the value of a characteristic.
- *
- * @param conn      A pointer to the DBusConnection.
- * @param msg       A pointer to the DBusMessage.
- * @param user_data A pointer to the user defined data.
+ * @brief This function is used to drop a characteristic from every device
+ * before it goes away.
  *
- * @return The function will return the reply message.
+ * @param chr   A pointer to the characteristic structure.
  */
-static DBusMessage *chr_read_value(DBusConnection *conn, DBusMessage *msg,
-							void *user_data)
+static void devices_forget_chr(struct characteristic *chr)
 {
-	struct characteristic *chr = user_data;
-	DBusMessage *reply;
-	DBusMessageIter iter;
-	const char *device;
+	GHashTable *devices = chr->hrs->hrp->devices;
+	GHashTableIter iter;
+	gpointer value;
 
-	if (!dbus_message_iter_init(msg, &iter))
-		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
-							"Invalid arguments");
-
-	if (parse_options(&iter, &device))
-		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
-							"Invalid arguments");
+	if (!devices)
+		return;
 
-	reply = dbus_message_new_method_return(msg);
-	if (!reply)
-		return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
-							"No Memory");
+	g_hash_table_iter_init(&iter, devices);
 
-	dbus_message_iter_init_append(reply, &iter);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct hrp_device *dev = value;
 
-	chr_read(chr, &iter);
+		dev->subscribed = g_slist_remove(dev->subscribed, chr);
+	}
 
-	return reply;
+	chr->subscribers = 0;
+	chr->sub_mtu = 0;
 }
 
 /**
- * @brief This function is used to handle a D-Bus method call for writing 
- * the value of a characteristic.
+ * @brief This function is used asa callback to retrieve the UUID property value
+ * of the descriptor.
  *
- * @param conn      A pointer to DBusConnection.
- * @param msg       A pointer to DBusMessage.
+ * @param property  A pointer to the GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
  * @param user_data A pointer to user defined data.
  *
- * @return The function creates a new method return message using 
- * dbus_message_new_method_return and return it.
+ * @return TRUE indicates the property value retrieval was successful.
  */
-static DBusMessage *chr_write_value(DBusConnection *conn, DBusMessage *msg,
-
-							void *user_data)
+static gboolean desc_get_uuid(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
 {
-	struct characteristic *chr = user_data;
-	DBusMessageIter iter;
-	const uint8_t *value;
-	int len;
-	const char *device;
+	struct descriptor *desc = user_data;
 
-	dbus_message_iter_init(msg, &iter);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &desc->uuid);
 
-	if (parse_value(&iter, &value, &len))
-		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
-							"Invalid arguments");
+	return TRUE;
+}
 
-	if (parse_options(&iter, &device))
-		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
-							"Invalid arguments");
+/**
+ * @brief This function is used as a callback to retrieve the characteristic
+ * property value of a descriptor.
+ *
+ * @param property  A pointer to the GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data.
+ * 
+ * @return TRUE indicates the property value retrieval was successful.
+ */
+static gboolean desc_get_characteristic(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct descriptor *desc = user_data;
 
-	chr_write(conn, chr, value, len);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH,
+						&desc->chr->path);
 
-	return dbus_message_new_method_return(msg);
+	return TRUE;
 }
 
 /**
- * @brief This function is used to send the notification.
- *
- * @param conn      A pointer to DBusConnection.
- * @param user_data A pointer to user defined data.
+ * @brief This function is used to append a value as a byte array.
  *
- * @return true on successful sending the notification.
+ * @param iter  A pointer to DBusMessageIter structure.
+ * @param value A pointer to the value.
+ * @param len   Length of the value.
  */
-static gboolean send_notification(DBusConnection *conn, void *user_data)
-
+static void append_value(DBusMessageIter *iter, const uint8_t *value, int len)
 {
-    struct characteristic *chr = user_data;
+	DBusMessageIter array;
 
-    uint8_t notification[] = {0x33, 0x34, 0x35};
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_BYTE_AS_STRING, &array);
 
-    chr_write(conn, chr, notification, sizeof(notification));
+	if (len)
+		dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE,
+							&value, len);
 
-    return true;
+	dbus_message_iter_close_container(iter, &array);
 }
 
 /**
- * @brief This function is used to start the notification.
+ * @brief This function is responsible for reading the value of a descriptor and
+ * appending it to a D-Bus message iterator.
  *
- * @param conn      A pointer to DBusConnection.
- * @param msg       A pointer to DBusMessage.
- * @param user_data A pointer to user defined data.
+ * @param desc  A pointer to the descriptor structure.
+ * @param iter  A pointer to DBusMessageIter structure.
  *
- * @return The function creates a new method return message using               
- * dbus_message_new_method_return and return it.
+ * @return true indicates the read operation was successful.
  */
-static DBusMessage *chr_start_notify(DBusConnection *conn, DBusMessage *msg,
-							void *user_data)
+static bool desc_read(struct descriptor *desc, DBusMessageIter *iter)
 {
-    DBusMessage *notify;
-    const GDBusPropertyTable *property;
-    DBusMessageIter *iter;
-    GDBusPendingPropertySet id;
-    struct characteristics *chr = user_data;
+	append_value(iter, desc->value, desc->vlen);
 
-    notify = dbus_message_new_method_return(msg);
-    if (!notify)
-	    return g_dbus_create_error(msg, DBUS_ERROR_NOT_SUPPORTED,
-		    					"Not Supported");
-    send_notification(conn, chr);
-    return notify;
+	return true;
 }
 
 /**
- * @brief This function is used to stop the notification.
+ * @brief This function is used as a callback to handle property access request
+ * for the Value property of a descriptor.
  *
- * @param conn      A pointer to DBusConnection.
- * @param msg       A pointer to DBusMessage.
- * @param user_data A pointer to user defined data.
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the user defined data.
  *
- * @return  returns GDBus error.
+ * @return This function returns the result of desc_read function which is a
+ * boolean value indicating the success of the read operation.
  */
-static DBusMessage *chr_stop_notify(DBusConnection *conn, DBusMessage *msg,
-							void *user_data)
+static gboolean desc_get_value(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
 {
+	struct descriptor *desc = user_data;
 
-    printf("Notification stopped\n");
-	return g_dbus_create_error(msg, DBUS_ERROR_NOT_SUPPORTED,
-							"Not Supported");
+	hrp_debug("Descriptor(%s): Get(\"Value\")", desc->uuid);
+
+	return desc_read(desc, iter);
 }
 
 /**
- * @brief represents the methods associated with the characteristic.
+ * @brief This function is used to drop a cached ReadValue reply after the
+ * value changed.
+ *
+ * @param cache A pointer to the cache slot.
  */
-static const GDBusMethodTable chr_methods[] = {
-	{ GDBUS_ASYNC_METHOD("ReadValue", GDBUS_ARGS({ "options", "a{sv}" }),
-					GDBUS_ARGS({ "value", "ay" }),
-					chr_read_value) },
-	{ GDBUS_ASYNC_METHOD("WriteValue", GDBUS_ARGS({ "value", "ay" },
-						{ "options", "a{sv}" }),
-					NULL, chr_write_value) },
-	{ GDBUS_ASYNC_METHOD("StartNotify", NULL, NULL, chr_start_notify) },
-	{ GDBUS_METHOD("StopNotify", NULL, NULL, chr_stop_notify) },
-	{ }
+static inline void invalidate_read_cache(DBusMessage **cache)
+{
+	if (*cache) {
+		dbus_message_unref(*cache);
+		*cache = NULL;
+	}
+}
+
+/**
+ * @brief This function is used to emit the coalesced PropertiesChanged for
+ * the Value of a descriptor.
+ *
+ * @param user_data A pointer to the descriptor structure.
+ *
+ * @return FALSE to remove the source.
+ */
+static gboolean desc_flush_value(gpointer user_data)
+{
+	struct descriptor *desc = user_data;
+
+	desc->coalesce_source = 0;
+
+	object_property_changed(desc->chr->hrs->hrp->om, desc->path,
+					GATT_DESCRIPTOR_IFACE, "Value");
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to handle the writing of a value to a descriptor.
+ *
+ * @param desc          A pointer to the descriptor structure.
+ * @param value         A pointer to the buffer containing the value to be written.
+ * @param len           Length of the value buffer.
+ * @param offset        Where to put the value, the value ends after it.
+ *
+ * @return 0 on success, -ERANGE if the offset is past the current value,
+ * -EINVAL if the value would exceed ATT_MAX_VALUE_LEN.
+ */
+static int desc_write(struct descriptor *desc, const uint8_t *value, int len,
+							uint16_t offset)
+{
+	struct hrp *hrp = desc->chr->hrs->hrp;
+
+	if (offset > desc->vlen)
+		return -ERANGE;
+
+	if (len < 0 || offset + len > ATT_MAX_VALUE_LEN)
+		return -EINVAL;
+
+	memcpy(desc->value + offset, value, len);
+	desc->vlen = offset + len;
+	invalidate_read_cache(&desc->read_cache);
+
+	/* Only a long write needs the assembled value */
+	if (offset)
+		sink_dispatch(hrp, desc->uuid, desc->value, desc->vlen, NULL);
+	else
+		sink_dispatch(hrp, desc->uuid, value, len, hrp->write_msg);
+
+	/* Later chunks of a long write are announced once, not per chunk */
+	if (desc->coalesce || offset) {
+		if (!desc->coalesce_source)
+			desc->coalesce_source = schedule_flush(hrp,
+							desc_flush_value, desc);
+		return 0;
+	}
+
+	object_property_changed(hrp->om, desc->path, GATT_DESCRIPTOR_IFACE,
+								"Value");
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to parse a value from D-Bus message iterator and
+ * retrieve the value and length of an array.
+ *
+ * @param iter  A pointer to DBusMessageIter structure.
+ * @param value A pointer to a pointer that will upated with the address of value array.
+ * @param len   A pointer to an integer that will update with the length of value array.
+ *
+ * The iterator is left on the next argument, the options of WriteValue.
+ *
+ * @return 0 indicates the successful parsing the value.
+ */
+static int parse_value(DBusMessageIter *iter, const uint8_t **value, int *len)
+{
+	DBusMessageIter array;
+
+	/* libdbus asserts on anything but an array of a fixed type */
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+			dbus_message_iter_get_element_type(iter) !=
+							DBUS_TYPE_BYTE)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(iter, &array);
+	dbus_message_iter_get_fixed_array(&array, value, len);
+	dbus_message_iter_next(iter);
+
+	return 0;
+}
+
+static const char *write_error_name(int err, const char **text);
+
+/**
+ * @brief This function is used to handle property setting request for Value
+ * property of a descriptor.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param id        The identifier of the pending property set operation.
+ * @param user_data A pointer to the user defined data.
+ */
+static void desc_set_value(const GDBusPropertyTable *property,
+				DBusMessageIter *iter,
+				GDBusPendingPropertySet id, void *user_data)
+{
+	struct descriptor *desc = user_data;
+	const uint8_t *value;
+	const char *name, *text;
+	int len, err;
+
+	hrp_debug("Descriptor(%s): Set(\"Value\", ...)", desc->uuid);
+
+	if (parse_value(iter, &value, &len)) {
+		hrp_warn("Invalid value for Set('Value'...)");
+		g_dbus_pending_property_error(id,
+					"error" ".InvalidArguments",
+					"Invalid arguments in method call");
+		return;
+	}
+
+	err = desc_write(desc, value, len, 0);
+	if (err) {
+		name = write_error_name(err, &text);
+		g_dbus_pending_property_error(id, name, "%s", text);
+		return;
+	}
+
+	g_dbus_pending_property_success(id);
+}
+
+/**
+ * @brief This function is used to retrieve the properties of a descriptor.
+ *
+ * @param property  A pointer to the GDBusPropertyTable structure.
+ * @param iter      A pointer to the DBusMessageIter structure.
+ * @param data      A pointer to the user defined data.
+ *
+ * @return TRUE indicating the property retrieval was successful.
+ */
+static gboolean desc_get_props(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *data)
+{
+	struct descriptor *desc = data;
+	DBusMessageIter array;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_STRING_AS_STRING, &array);
+
+	for (i = 0; desc->props[i]; i++)
+		dbus_message_iter_append_basic(&array,
+					DBUS_TYPE_STRING, &desc->props[i]);
+
+	dbus_message_iter_close_container(iter, &array);
+
+	return TRUE;
+}
+
+/**
+ * @brief An array called desc_properties of type GDBusPropertyTable.
+ */
+static const GDBusPropertyTable desc_properties[] = {
+	{ "UUID",		"s", desc_get_uuid },
+	{ "Characteristic",	"o", desc_get_characteristic },
+	{ "Value",		"ay", desc_get_value, desc_set_value, NULL },
+	{ "Flags",		"as", desc_get_props, NULL, NULL },
+	{ }
+};
+
+/**
+ * @brief This function is a callback to retrieve the UUID property value of a 
+ * characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean chr_get_uuid(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &chr->uuid);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used as a callback to retrieve the Service property
+ * value of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data. 
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean chr_get_service(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH,
+							&chr->service);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is responsible for reading the value of a characteristic
+ * and appending it to a D-Bus message iterator.
+ *
+ * @param chr   A pointer to characteristic structure.
+ * @param iter  A pointer to DBusMessageIter structure.
+ * @return true indicates the read operation was successful.
+ */
+static bool chr_read(struct characteristic *chr, DBusMessageIter *iter)
+{
+	append_value(iter, chr->value, chr->vlen);
+
+	return true;
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Value property of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.                  
+ * @param iter      A pointer to DBusMessageIter structure.                 
+ * @param user_data A pointer to user defined data.                         
+ *                                                                              
+ * @return This function will returns the result of the chr_read function.
+ */
+static gboolean chr_get_value(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	hrp_debug("Characteristic(%s): Get(\"Value\")", chr->uuid);
+
+	return chr_read(chr, iter);
+}
+
+/**
+ * @brief This function is used to retrieve the properties of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.                  
+ * @param iter      A pointer to DBusMessageIter structure.                 
+ * @param user_data A pointer to user defined data.                         
+ *                                                                              
+ * @return TRUE indicate the property value retrieval was successful.       
+ */
+static gboolean chr_get_props(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *data)
+{
+	struct characteristic *chr = data;
+	DBusMessageIter array;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_STRING_AS_STRING, &array);
+
+	for (i = 0; chr->props[i]; i++)
+		dbus_message_iter_append_basic(&array,
+					DBUS_TYPE_STRING, &chr->props[i]);
+
+	dbus_message_iter_close_container(iter, &array);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used to set the function told about congestion.
+ *
+ * @param hrp       A pointer to the context.
+ * @param func      The function, NULL to remove it.
+ * @param user_data A pointer passed to func.
+ */
+void set_congestion_cb(struct hrp *hrp, congestion_func_t func,
+							void *user_data)
+{
+	hrp->congestion_func = func;
+	hrp->congestion_data = user_data;
+}
+
+/**
+ * @brief This function is used to tell whether an instance is congested.
+ *
+ * @param hrp   A pointer to the context.
+ * @param index The service instance number.
+ *
+ * @return true while the instance is above its high-water mark.
+ */
+bool notify_congested(struct hrp *hrp, unsigned int index)
+{
+	struct hr_service *hrs = find_hr_service(hrp, index);
+
+	return hrs && atomic_load_explicit(&hrs->congested,
+						memory_order_relaxed);
+}
+
+/**
+ * @brief This function is used to update the congestion state of a
+ * characteristic and with it that of its instance.
+ *
+ * @param chr       A pointer to the characteristic structure.
+ * @param congested Whether its queue reached the high-water mark.
+ */
+static void chr_set_congested(struct characteristic *chr, bool congested)
+{
+	struct hr_service *hrs = chr->hrs;
+
+	if (chr->congested == congested)
+		return;
+
+	chr->congested = congested;
+
+	if (congested && hrs->n_congested++)
+		return;
+
+	if (!congested && --hrs->n_congested)
+		return;
+
+	atomic_store_explicit(&hrs->congested, congested,
+						memory_order_relaxed);
+
+	hrp_info("Service %s: %s", hrs->path,
+			congested ? "congested" : "recovered");
+
+	if (hrs->hrp->congestion_func)
+		hrs->hrp->congestion_func(hrs->index, congested,
+						hrs->hrp->congestion_data);
+}
+
+/**
+ * @brief This function is used to release the notification socket handed out
+ * by AcquireNotify.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ */
+static void chr_release_notify_io(struct characteristic *chr)
+{
+	if (!chr->notify_io)
+		return;
+
+	if (chr->notify_watch)
+		g_source_remove(chr->notify_watch);
+
+	if (chr->notify_out_watch)
+		g_source_remove(chr->notify_out_watch);
+
+	/* Whatever is still queued has nowhere to go */
+	notify_queue_free(chr->notify_queue);
+	chr->notify_queue = NULL;
+	chr->notify_out_watch = 0;
+	chr_set_congested(chr, false);
+
+	g_io_channel_shutdown(chr->notify_io, FALSE, NULL);
+	g_io_channel_unref(chr->notify_io);
+
+	chr->notify_io = NULL;
+	chr->notify_watch = 0;
+
+	object_property_changed(chr->hrs->hrp->om, chr->path, GATT_CHR_IFACE,
+							"NotifyAcquired");
+}
+
+/**
+ * @brief This function is used to release the write socket handed out by
+ * AcquireWrite.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ */
+static void chr_release_write_io(struct characteristic *chr)
+{
+	if (!chr->write_io)
+		return;
+
+	if (chr->write_watch)
+		g_source_remove(chr->write_watch);
+
+	g_io_channel_shutdown(chr->write_io, FALSE, NULL);
+	g_io_channel_unref(chr->write_io);
+
+	chr->write_io = NULL;
+	chr->write_watch = 0;
+
+	object_property_changed(chr->hrs->hrp->om, chr->path, GATT_CHR_IFACE,
+							"WriteAcquired");
+}
+
+/**
+ * @brief This function is used to send queued notifications once the notify
+ * socket is writable again.
+ *
+ * @param io        A pointer to the GIOChannel.
+ * @param cond      The condition that triggered the callback.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE while notifications are left in the queue.
+ */
+static gboolean chr_notify_io_drain(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct characteristic *chr = user_data;
+	const uint8_t *value;
+	uint64_t queued_at;
+	int fd, len;
+
+	fd = g_io_channel_unix_get_fd(io);
+
+	while (notify_queue_peek(chr->notify_queue, &value, &len, &queued_at)) {
+		if (send(fd, value, len, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+			unsigned int n;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return TRUE;
+
+			/*
+			 * Not every hard error comes with a hangup, e.g.
+			 * EMSGSIZE, so don't wait for the HUP watch. What
+			 * is queued has nowhere to go.
+			 */
+			stats_inc(&chr->stats.errors);
+			for (n = notify_queue_length(chr->notify_queue); n; n--)
+				stats_inc(&chr->stats.drops);
+
+			hrp_warn("Characteristic(%s): notify socket error: %s",
+						chr->uuid, strerror(errno));
+
+			/* Removes this source too */
+			chr_release_notify_io(chr);
+
+			return FALSE;
+		}
+
+		stats_inc(&chr->stats.notifications);
+		stats_record(chr->stats.latency, queued_at);
+
+		notify_queue_pop(chr->notify_queue);
+	}
+
+	chr->notify_out_watch = 0;
+	chr_set_congested(chr, false);
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to queue a notification the notify socket
+ * could not take.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ * @param value A pointer to the value, already cut to the MTU.
+ * @param len   Length of the value.
+ * @param start The time the value was written.
+ */
+static void chr_notify_enqueue(struct characteristic *chr,
+				const uint8_t *value, int len, uint64_t start)
+{
+	struct hrp *hrp = chr->hrs->hrp;
+	unsigned int high_water;
+
+	if (!chr->notify_queue)
+		chr->notify_queue = notify_queue_new(hrp->notify_queue_len,
+						hrp->notify_queue_policy);
+
+	if (!chr->notify_queue) {
+		stats_inc(&chr->stats.drops);
+		return;
+	}
+
+	if (notify_queue_push(chr->notify_queue, value, len, start))
+		stats_inc(&chr->stats.drops);
+
+	if (!chr->notify_out_watch)
+		chr->notify_out_watch = g_io_add_watch(chr->notify_io,
+						G_IO_OUT, chr_notify_io_drain,
+						chr);
+
+	/* A coalescing queue never holds more than one notification */
+	if (hrp->notify_queue_policy == NOTIFY_COALESCE_LATEST)
+		high_water = 1;
+	else if (hrp->notify_queue_high_water)
+		high_water = MIN(hrp->notify_queue_high_water,
+						hrp->notify_queue_len);
+	else
+		high_water = hrp->notify_queue_len;
+
+	if (notify_queue_length(chr->notify_queue) >= high_water)
+		chr_set_congested(chr, true);
+}
+
+/**
+ * @brief This function is used to send a value over the notification socket.
+ *
+ * The socket is a SOCK_SEQPACKET so each write is delivered by bluetoothd as
+ * one notification. The value is truncated to what fits into the MTU.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ * @param value A pointer to the buffer containing the value to be sent.
+ * @param len   Length of the value buffer.
+ * @param start The time the value was written, for the latency histogram.
+ *
+ * @return true if the value was handled by the socket, false if the caller
+ * has to fall back to PropertiesChanged.
+ */
+static bool chr_notify_io_write(struct characteristic *chr,
+					const uint8_t *value, int len,
+					uint64_t start)
+{
+	ssize_t ret;
+	int fd;
+
+	if (chr->mtu > ATT_NOTIFY_HDR_LEN && len > chr->mtu - ATT_NOTIFY_HDR_LEN)
+		len = chr->mtu - ATT_NOTIFY_HDR_LEN;
+
+	/* Nothing overtakes what is already waiting for the link */
+	if (notify_queue_length(chr->notify_queue)) {
+		chr_notify_enqueue(chr, value, len, start);
+		return true;
+	}
+
+	fd = g_io_channel_unix_get_fd(chr->notify_io);
+
+	ret = send(fd, value, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (ret >= 0) {
+		stats_inc(&chr->stats.notifications);
+		stats_record(chr->stats.latency, start);
+		return true;
+	}
+
+	/* Link is busy, queue rather than blocking the main loop */
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		chr_notify_enqueue(chr, value, len, start);
+		return true;
+	}
+
+	stats_inc(&chr->stats.errors);
+
+	hrp_warn("Characteristic(%s): notify socket error: %s", chr->uuid,
+							strerror(errno));
+	chr_release_notify_io(chr);
+
+	return false;
+}
+
+/**
+ * @brief This function is used to emit the coalesced PropertiesChanged for
+ * the Value of a characteristic.
+ *
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return FALSE to remove the source.
+ */
+static gboolean chr_flush_value(gpointer user_data)
+{
+	struct characteristic *chr = user_data;
+
+	chr->coalesce_source = 0;
+
+	object_property_changed(chr->hrs->hrp->om, chr->path, GATT_CHR_IFACE,
+								"Value");
+
+	if (chr->notifying) {
+		stats_inc(&chr->stats.notifications);
+		stats_record(chr->stats.latency, chr->stats.pending_since);
+	}
+
+	return FALSE;
+}
+
+/* Heart Rate Control Point opcodes */
+#define HR_CTRL_PT_RESET_ENERGY         0x01
+
+/* ATT application error for opcodes the control point does not support */
+#define HR_CTRL_PT_NOT_SUPPORTED        "0x80"
+
+/**
+ * @brief This function is used to set the Energy Expended accumulator of an
+ * instance. The measurement carries it in kilo Joules, saturated at 0xffff,
+ * so it only has to be recomputed when the accumulator changes.
+ *
+ * @param hrs       A pointer to the service instance.
+ * @param joules    The accumulated energy in Joules.
+ */
+static void hrs_set_energy(struct hr_service *hrs, uint32_t joules)
+{
+	struct hrp_state_instance *si;
+	uint16_t energy = MIN(joules / 1000, 0xffff);
+
+	hrs->energy = joules;
+	hrs->hrm.energy_present = true;
+
+	if (energy == hrs->hrm.energy)
+		return;
+
+	hrs->hrm.energy = energy;
+	hrs->pending = true;
+
+	si = state_instance(hrs);
+	if (si && (!(si->valid & HRP_STATE_ENERGY) || si->energy != energy)) {
+		si->valid |= HRP_STATE_ENERGY;
+		si->energy = energy;
+		state_sync(hrs->hrp->state);
+	}
+}
+
+/**
+ * @brief This function is used to handle the Reset Energy Expended command.
+ *
+ * @param hrs   A pointer to the service instance.
+ * @param value A pointer to the command.
+ * @param len   Length of the command.
+ *
+ * @return 0 on success.
+ */
+static int ctrl_pt_reset_energy(struct hr_service *hrs, const uint8_t *value,
+								int len)
+{
+	hrp_info("Service %u: Energy Expended reset", hrs->index + 1);
+
+	hrs_set_energy(hrs, 0);
+
+	return 0;
+}
+
+/**
+ * @struct ctrl_pt_cmd
+ * Represents one Heart Rate Control Point command, indexed by opcode
+ */
+struct ctrl_pt_cmd {
+	int len;
+	int (*func)(struct hr_service *hrs, const uint8_t *value, int len);
+};
+
+static const struct ctrl_pt_cmd ctrl_pt_cmds[] = {
+	[HR_CTRL_PT_RESET_ENERGY] = { 1, ctrl_pt_reset_energy },
+};
+
+/**
+ * @brief This function is used to validate and run a write to the Heart Rate
+ * Control Point.
+ *
+ * @param hrs       A pointer to the service instance.
+ * @param value     A pointer to the written value.
+ * @param len       Length of the value.
+ * @param offset    The offset of the write.
+ *
+ * @return 0 on success, -ERANGE for a non-zero offset, -EINVAL if the
+ * length does not match the command and -EOPNOTSUPP for unknown opcodes.
+ */
+static int ctrl_pt_dispatch(struct hr_service *hrs, const uint8_t *value,
+						int len, uint16_t offset)
+{
+	const struct ctrl_pt_cmd *cmd;
+
+	if (offset)
+		return -ERANGE;
+
+	if (len < 1)
+		return -EINVAL;
+
+	if (value[0] >= G_N_ELEMENTS(ctrl_pt_cmds) ||
+					!ctrl_pt_cmds[value[0]].func) {
+		hrp_debug("Service %u: unsupported control point opcode 0x%02x",
+						hrs->index + 1, value[0]);
+		return -EOPNOTSUPP;
+	}
+
+	cmd = &ctrl_pt_cmds[value[0]];
+	if (len != cmd->len)
+		return -EINVAL;
+
+	return cmd->func(hrs, value, len);
+}
+
+/**                                                                             
+ * @brief This function is used to handle the writing of a value to a characteristic.
+ *                                                                              
+ * If the notification socket has been acquired the value is written to it,
+ * otherwise a PropertiesChanged signal is emitted for the Value property.
+ *
+ * @param chr           A pointer to the characteristic structure.                  
+ * @param value         A pointer to the buffer containing the value to be written.
+ * @param len           Length of the value buffer.                             
+ * @param offset        Where to put the value, the value ends after it.
+ *                                                                              
+ * Writes to the Heart Rate Control Point run the command first. Values of
+ * write-only characteristics are only handed to the sink, never stored, so
+ * they cannot be written at an offset.
+ *
+ * @return 0 on success, -ERANGE if the offset is past the current value,
+ * -EINVAL if the value would exceed ATT_MAX_VALUE_LEN, or the error of the
+ * control point command.
+ */
+static int chr_write(struct characteristic *chr, const uint8_t *value, int len,
+							uint16_t offset)
+{
+	struct hrp *hrp = chr->hrs->hrp;
+	uint64_t start = stats_now();
+	int err;
+
+	if (offset > chr->vlen) {
+		stats_inc(&chr->stats.errors);
+		return -ERANGE;
+	}
+
+	if (len < 0 || offset + len > ATT_MAX_VALUE_LEN) {
+		stats_inc(&chr->stats.errors);
+		return -EINVAL;
+	}
+
+	if (chr == chr->hrs->ctrl_pt) {
+		err = ctrl_pt_dispatch(chr->hrs, value, len, offset);
+		if (err) {
+			stats_inc(&chr->stats.errors);
+			return err;
+		}
+	}
+
+	/* Nobody can read a write-only value back, it is not even stored */
+	if (!(chr->flags & (PROP_READ | PROP_NOTIFY | PROP_INDICATE))) {
+		if (offset) {
+			stats_inc(&chr->stats.errors);
+			return -ERANGE;
+		}
+
+		sink_dispatch(hrp, chr->uuid, value, len, hrp->write_msg);
+		return 0;
+	}
+
+	memcpy(chr->value + offset, value, len);
+	chr->vlen = offset + len;
+	invalidate_read_cache(&chr->read_cache);
+
+	if (chr == chr->hrs->location)
+		state_save_location(chr);
+
+	if (offset)
+		sink_dispatch(hrp, chr->uuid, chr->value, chr->vlen, NULL);
+	else
+		sink_dispatch(hrp, chr->uuid, value, len, hrp->write_msg);
+
+	if (!offset && chr->notify_io &&
+			chr_notify_io_write(chr, value, len, start))
+		return 0;
+
+	/* Later chunks of a long write are announced once, not per chunk */
+	if (chr->coalesce || offset) {
+		if (!chr->coalesce_source) {
+			chr->stats.pending_since = start;
+			chr->coalesce_source = schedule_flush(hrp,
+							chr_flush_value, chr);
+		}
+		return 0;
+	}
+
+	object_property_changed(hrp->om, chr->path, GATT_CHR_IFACE, "Value");
+
+	/* bluetoothd only turns it into a notification while notifying */
+	if (chr->notifying) {
+		stats_inc(&chr->stats.notifications);
+		stats_record(chr->stats.latency, start);
+	}
+
+	return 0;
+}
+
+/**                                                                             
+ * @brief This function is used to handle property setting request for Value    
+ * property of a characteristic.                                                    
+ *                                                                              
+ * @param property  A pointer to GDBusPropertyTable structure.                  
+ * @param iter      A pointer to DBusMessageIter structure.                     
+ * @param id        The identifier of the pending property set operation.       
+ * @param user_data A pointer to the user defined data.                         
+ */                
+static void chr_set_value(const GDBusPropertyTable *property,
+				DBusMessageIter *iter,
+				GDBusPendingPropertySet id, void *user_data)
+{
+	struct characteristic *chr = user_data;
+	const uint8_t *value;
+	const char *name, *text;
+	int len, err;
+
+	hrp_debug("Characteristic(%s): Set('Value', ...)", chr->uuid);
+
+	stats_inc(&chr->stats.writes);
+
+	if (parse_value(iter, &value, &len)) {
+		hrp_warn("Invalid value for Set('Value'...)");
+		g_dbus_pending_property_error(id,
+					"ERROR_INTERFACE" ".InvalidArguments",
+					"Invalid arguments in method call");
+		return;
+	}
+
+	err = chr_write(chr, value, len, 0);
+	if (err) {
+		name = write_error_name(err, &text);
+		g_dbus_pending_property_error(id, name, "%s", text);
+		return;
+	}
+
+	g_dbus_pending_property_success(id);
+}
+
+/**
+ * @brief This function is used to check whether a characteristic has the
+ * given flag in its properties.
+ *
+ * @param chr   A pointer to characteristic structure.
+ * @param flag  The PROP_* bit of the flag.
+ *
+ * @return true if the flag is present.
+ */
+static bool chr_has_prop(const struct characteristic *chr, unsigned int flag)
+{
+	return chr->flags & flag;
+}
+
+/**
+ * @brief This function is used as a callback to retrieve the NotifyAcquired
+ * property value of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean chr_get_notify_acquired(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+	dbus_bool_t value = chr->notify_io ? TRUE : FALSE;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &value);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used to check whether the NotifyAcquired property
+ * exists for a characteristic. Only characteristics supporting notifications
+ * expose it, which is what makes bluetoothd use AcquireNotify.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE if the characteristic supports notifications.
+ */
+static gboolean chr_notify_acquired_exists(const GDBusPropertyTable *property,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return chr_has_prop(chr, PROP_NOTIFY);
+}
+
+/**
+ * @brief This function is used as a callback to retrieve the Notifying
+ * property value of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean chr_get_notifying(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+	dbus_bool_t value = chr->notifying ? TRUE : FALSE;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &value);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used as a callback to retrieve the WriteAcquired
+ * property value of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean chr_get_write_acquired(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+	dbus_bool_t value = chr->write_io ? TRUE : FALSE;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &value);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used to check whether the WriteAcquired property
+ * exists for a characteristic, i.e. whether it can be written at all.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE if the characteristic is writable.
+ */
+static gboolean chr_write_acquired_exists(const GDBusPropertyTable *property,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return chr_has_prop(chr, PROP_WRITE | PROP_WRITE_WITHOUT_RESP);
+}
+
+/**
+ * @brief This function is used to check whether the MTU property exists for
+ * a characteristic. It is only meaningful when a socket can be acquired.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE if either AcquireNotify or AcquireWrite is supported.
+ */
+static gboolean chr_mtu_exists(const GDBusPropertyTable *property,
+							void *user_data)
+{
+	return chr_notify_acquired_exists(property, user_data) ||
+			chr_write_acquired_exists(property, user_data);
+}
+
+/**
+ * @brief This function is used as a callback to retrieve the MTU property
+ * value of a characteristic.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean chr_get_mtu(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+	dbus_uint16_t mtu = chr->mtu ? chr->mtu : ATT_DEFAULT_LE_MTU;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT16, &mtu);
+
+	return TRUE;
+}
+
+/**
+ * @brief An array called chr_properties of type GDBusPropertyTable.  
+ */
+static const GDBusPropertyTable chr_properties[] = {
+	{ "UUID",	"s", chr_get_uuid },
+	{ "Service",	"o", chr_get_service },
+	{ "Value",	"ay", chr_get_value, chr_set_value, NULL },
+	{ "Flags",	"as", chr_get_props, NULL, NULL },
+	{ "Notifying",	"b", chr_get_notifying, NULL,
+					chr_notify_acquired_exists },
+	{ "NotifyAcquired", "b", chr_get_notify_acquired, NULL,
+					chr_notify_acquired_exists },
+	{ "WriteAcquired", "b", chr_get_write_acquired, NULL,
+					chr_write_acquired_exists },
+	{ "MTU",	"q", chr_get_mtu, NULL, chr_mtu_exists },
+	{ }
+};
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for Primary property of a service.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.                  
+ * @param iter      A pointer to DBusMessageIter structure.                 
+ * @param user_data A pointer to user defined data.                         
+ *                                                                              
+ * @return TRUE indicate the property value retrieval was successful.                     
+ */
+static gboolean service_get_primary(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	dbus_bool_t primary = TRUE;
+
+	hrp_debug("Get Primary: %s", primary ? "True" : "False");
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &primary);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request 
+ * for UUID property of a service. 
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.                  
+ * @param iter      A pointer to DBusMessageIter structure.                     
+ * @param user_data A pointer to user defined data.                             
+ *                                                                              
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean service_get_uuid(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	const char *uuid = user_data;
+
+	hrp_debug("Get UUID: %s", uuid);
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &uuid);
+
+	return TRUE;
+}
+
+/**                                                                             
+ * @brief An array called service_properties of type GDBusPropertyTable.            
+ */
+static const GDBusPropertyTable service_properties[] = {
+	{ "Primary", "b", service_get_primary },
+	{ "UUID", "s", service_get_uuid },
+	{ "Includes", "ao",},
+	{ }
+};
+
+/**
+ * @brief This function is used as a callback to handle the distraction of a
+ * GATT characteristic interface. The memory itself belongs to the service
+ * arena, only timers and sockets are released here.
+ *
+ * @param user_data A pointer to user defined data associated with chr interface.
+ *
+ */
+static void chr_iface_destroy(gpointer user_data)
+{
+	struct characteristic *chr = user_data;
+
+	if (chr->coalesce_source)
+		g_source_remove(chr->coalesce_source);
+	if (chr->notify_timer)
+		g_source_remove(chr->notify_timer);
+	if (chr->notifying)
+		chr->hrs->hrp->notifying = g_slist_remove(
+					chr->hrs->hrp->notifying, chr);
+	if (chr->notify_watch)
+		g_source_remove(chr->notify_watch);
+	if (chr->notify_out_watch)
+		g_source_remove(chr->notify_out_watch);
+	if (chr->notify_io)
+		g_io_channel_unref(chr->notify_io);
+	if (chr->write_watch)
+		g_source_remove(chr->write_watch);
+	if (chr->write_io)
+		g_io_channel_unref(chr->write_io);
+
+	invalidate_read_cache(&chr->read_cache);
+	notify_queue_free(chr->notify_queue);
+
+	chr->coalesce_source = 0;
+	chr->notify_timer = 0;
+	chr->notifying = false;
+	chr->notify_watch = 0;
+	chr->notify_out_watch = 0;
+	chr->notify_queue = NULL;
+	chr->notify_io = NULL;
+	chr->write_watch = 0;
+	chr->write_io = NULL;
+}
+
+/**
+ * @brief This function is used as a callback to handle the distraction of a 
+ * descriptor interface. The memory itself belongs to the service arena.
+ *
+ * @param user_data A pointer to user defined data associated with desc interface.
+ */
+static void desc_iface_destroy(gpointer user_data)
+{
+	struct descriptor *desc = user_data;
+
+	if (desc->coalesce_source)
+		g_source_remove(desc->coalesce_source);
+
+	invalidate_read_cache(&desc->read_cache);
+
+	desc->coalesce_source = 0;
+}
+
+/**
+ * @enum write_type
+ * Represents the "type" option of WriteValue
+ */
+enum write_type {
+	WRITE_TYPE_REQUEST,
+	WRITE_TYPE_COMMAND,
+	WRITE_TYPE_RELIABLE,
+};
+
+/**
+ * @struct attr_options
+ * Represents the options dictionary of ReadValue, WriteValue and Acquire*
+ */
+struct attr_options {
+	const char *device;
+	uint16_t mtu;
+	uint16_t offset;
+	enum write_type type;
+	dbus_bool_t prepare_authorize;
+};
+
+/**
+ * @brief This function is used to parse options from D-Bus message iterator.
+ *
+ * Options that are absent leave the corresponding field untouched, so the
+ * caller initialises the defaults.
+ *
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param opts      A pointer to the options to fill in.
+ *
+ * @return 0 indicates the successful parsing.
+ */
+static int parse_options(DBusMessageIter *iter, struct attr_options *opts)
+{
+	DBusMessageIter dict;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+			dbus_message_iter_get_element_type(iter) !=
+							DBUS_TYPE_DICT_ENTRY)
+		return -EINVAL;
+
+	dbus_message_iter_recurse(iter, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY) {
+		const char *key, *type;
+		DBusMessageIter value, entry;
+		int var;
+
+		dbus_message_iter_recurse(&dict, &entry);
+
+		/* Anything but a{sv} would be read into the wrong type */
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+			return -EINVAL;
+
+		dbus_message_iter_get_basic(&entry, &key);
+
+		dbus_message_iter_next(&entry);
+		if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT)
+			return -EINVAL;
+
+		dbus_message_iter_recurse(&entry, &value);
+
+		var = dbus_message_iter_get_arg_type(&value);
+		if (strcasecmp(key, "device") == 0) {
+			if (var != DBUS_TYPE_OBJECT_PATH)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value, &opts->device);
+			hrp_debug("Device: %s", opts->device);
+		} else if (strcasecmp(key, "mtu") == 0) {
+			if (var != DBUS_TYPE_UINT16)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value, &opts->mtu);
+		} else if (strcasecmp(key, "offset") == 0) {
+			if (var != DBUS_TYPE_UINT16)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value, &opts->offset);
+		} else if (strcasecmp(key, "type") == 0) {
+			if (var != DBUS_TYPE_STRING)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value, &type);
+			if (strcasecmp(type, "request") == 0)
+				opts->type = WRITE_TYPE_REQUEST;
+			else if (strcasecmp(type, "command") == 0)
+				opts->type = WRITE_TYPE_COMMAND;
+			else if (strcasecmp(type, "reliable") == 0)
+				opts->type = WRITE_TYPE_RELIABLE;
+			else
+				return -EINVAL;
+		} else if (strcasecmp(key, "prepare-authorize") == 0) {
+			if (var != DBUS_TYPE_BOOLEAN)
+				return -EINVAL;
+			dbus_message_iter_get_basic(&value,
+						&opts->prepare_authorize);
+		}
+
+		dbus_message_iter_next(&dict);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to work out how much of a value a ReadValue
+ * returns: everything from the offset on, but no more than fits into one
+ * ATT Read Blob response.
+ *
+ * @param vlen  Length of the whole value.
+ * @param opts  A pointer to the parsed options, offset already checked.
+ *
+ * @return The number of bytes to return.
+ */
+static int read_len(int vlen, const struct attr_options *opts)
+{
+	int len = vlen - opts->offset;
+
+	if (opts->mtu > 1 && len > opts->mtu - 1)
+		len = opts->mtu - 1;
+
+	return len;
+}
+
+/**
+ * @brief This function is used to build a ReadValue reply carrying part of
+ * a value.
+ *
+ * @param msg   A pointer to the method call being answered.
+ * @param value A pointer to the first byte to return.
+ * @param len   Number of bytes to return.
+ *
+ * @return The reply message.
+ */
+static DBusMessage *read_slice_reply(DBusMessage *msg, const uint8_t *value,
+								int len)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
+							"No Memory");
+
+	dbus_message_iter_init_append(reply, &iter);
+	append_value(&iter, value, len);
+
+	return reply;
+}
+
+/**
+ * @brief This function is used to map a chr_write() or desc_write() error
+ * to the BlueZ error name, for WriteValue and Set("Value") alike.
+ *
+ * @param err   The negative error code.
+ * @param text  A pointer that will be updated with the error message.
+ *
+ * @return The BlueZ error name.
+ */
+static const char *write_error_name(int err, const char **text)
+{
+	if (err == -ERANGE) {
+		*text = "Invalid offset";
+		return "org.bluez.Error.InvalidOffset";
+	}
+
+	/* bluetoothd turns the message into the ATT application error */
+	if (err == -EOPNOTSUPP) {
+		*text = HR_CTRL_PT_NOT_SUPPORTED;
+		return "org.bluez.Error.Failed";
+	}
+
+	*text = "Invalid value length";
+	return "org.bluez.Error.InvalidValueLength";
+}
+
+/**
+ * @brief This function is used to map a chr_write() or desc_write() error
+ * to the BlueZ error reply.
+ *
+ * @param msg   A pointer to the method call being answered.
+ * @param err   The negative error code.
+ *
+ * @return The error reply.
+ */
+static DBusMessage *write_error(DBusMessage *msg, int err)
+{
+	const char *name, *text;
+
+	name = write_error_name(err, &text);
+
+	return g_dbus_create_error(msg, name, "%s", text);
+}
+
+/**
+ * @brief This function is used to build a ReadValue reply from the cached,
+ * already marshalled value. Only the reply serial and the destination are
+ * filled in, the body is copied as is.
+ *
+ * @param cache A pointer to the cached method return.
+ * @param msg   A pointer to the method call being answered.
+ *
+ * @return The reply or NULL if out of memory.
+ */
+DBusMessage *reply_from_cache(DBusMessage *cache, DBusMessage *msg)
+{
+	const char *sender = dbus_message_get_sender(msg);
+	DBusMessage *reply;
+
+	reply = dbus_message_copy(cache);
+	if (!reply)
+		return NULL;
+
+	if (!dbus_message_set_reply_serial(reply, dbus_message_get_serial(msg)) ||
+			(sender && !dbus_message_set_destination(reply, sender))) {
+		dbus_message_unref(reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+/**
+ * @brief This function is used to handle D-Bus method call for reading
+ * the value of a characteristic.
+ *
+ * @param conn      A pointer to the DBusConnection.
+ * @param msg       A pointer to the DBusMessage.
+ * @param user_data A pointer to the user defined data.
+ *
+ * @return The function will return the reply message.
+ */
+static DBusMessage *chr_handle_read(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+	DBusMessage *reply;
+	DBusMessageIter iter;
+	struct attr_options opts = { .device = NULL };
+	int len;
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	if (parse_options(&iter, &opts))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	device_seen(chr->hrs->hrp, opts.device, opts.mtu);
+
+	if (opts.offset > chr->vlen)
+		return g_dbus_create_error(msg, "org.bluez.Error.InvalidOffset",
+							"Invalid offset");
+
+	/* Only the plain read of the whole value is worth caching */
+	len = read_len(chr->vlen, &opts);
+	if (opts.offset || len < chr->vlen)
+		return read_slice_reply(msg, chr->value + opts.offset, len);
+
+	if (!chr->read_cache) {
+		chr->read_cache = dbus_message_new(
+					DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		if (!chr->read_cache)
+			return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
+							"No Memory");
+
+		dbus_message_iter_init_append(chr->read_cache, &iter);
+
+		chr_read(chr, &iter);
+	}
+
+	reply = reply_from_cache(chr->read_cache, msg);
+	if (!reply)
+		return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
+							"No Memory");
+
+	return reply;
+}
+
+/**
+ * @brief This function is used to handle a D-Bus method call for writing 
+ * the value of a characteristic.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The function creates a new method return message using 
+ * dbus_message_new_method_return and return it, or NULL for a write command
+ * sent without expecting a reply.
+ */
+static DBusMessage *chr_handle_write(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+	DBusMessageIter iter;
+	const uint8_t *value;
+	int len, err;
+	struct attr_options opts = { .device = NULL };
+	bool no_reply;
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	if (parse_value(&iter, &value, &len))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	if (parse_options(&iter, &opts))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	device_seen(chr->hrs->hrp, opts.device, opts.mtu);
+
+	/* Authorizing a prepared write, the data follows with the execute */
+	if (opts.prepare_authorize)
+		return dbus_message_new_method_return(msg);
+
+	no_reply = dbus_message_get_no_reply(msg);
+
+	if (opts.type == WRITE_TYPE_COMMAND &&
+				!chr_has_prop(chr, PROP_WRITE_WITHOUT_RESP)) {
+		stats_inc(&chr->stats.errors);
+		return no_reply ? NULL : g_dbus_create_error(msg,
+						DBUS_ERROR_NOT_SUPPORTED,
+						"Not Supported");
+	}
+
+	chr->hrs->hrp->write_msg = msg;
+	err = chr_write(chr, value, len, opts.offset);
+	chr->hrs->hrp->write_msg = NULL;
+
+	/* Write Without Response, nobody is waiting for the reply */
+	if (no_reply)
+		return NULL;
+
+	if (err)
+		return write_error(msg, err);
+
+	return dbus_message_new_method_return(msg);
+}
+
+/**
+ * @brief This function is used to account a finished method handler.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ * @param start The time the handler was entered.
+ * @param reply The reply returned by the handler.
+ *
+ * @return The reply, passed through.
+ */
+static DBusMessage *chr_handler_done(struct characteristic *chr,
+					uint64_t start, DBusMessage *reply)
+{
+	/* No reply at all is fine for write commands */
+	stats_handler_done(&chr->stats, start, reply &&
+			dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR);
+
+	return reply;
+}
+
+/**
+ * @brief This function is used to handle D-Bus method call for reading
+ * the value of a characteristic, accounting it in the statistics.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The reply message.
+ */
+static DBusMessage *chr_read_value(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+	uint64_t start = stats_now();
+
+	stats_inc(&chr->stats.reads);
+
+	return chr_handler_done(chr, start,
+				chr_handle_read(conn, msg, user_data));
+}
+
+/**
+ * @brief This function is used to handle a D-Bus method call for writing
+ * the value of a characteristic, accounting it in the statistics.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The reply message.
+ */
+static DBusMessage *chr_write_value(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+	uint64_t start = stats_now();
+
+	stats_inc(&chr->stats.writes);
+
+	return chr_handler_done(chr, start,
+				chr_handle_write(conn, msg, user_data));
+}
+
+/**
+ * @brief This function is used to send the notification.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ *
+ * @return true on successful sending the notification.
+ */
+static gboolean send_notification(struct characteristic *chr)
+{
+	uint8_t notification[ATT_MAX_VALUE_LEN];
+	uint16_t mtu = chr->mtu ? chr->mtu : ATT_DEFAULT_LE_MTU;
+	int len;
+
+	/* Encode for the smallest MTU so every subscriber gets all of it */
+	if (chr->sub_mtu && chr->sub_mtu < mtu)
+		mtu = chr->sub_mtu;
+
+	/* Anything but the measurement just notifies its current value */
+	if (chr != chr->hrs->msrmt) {
+		memcpy(notification, chr->value, chr->vlen);
+		return !chr_write(chr, notification, chr->vlen, 0);
+	}
+
+	len = hrm_encode(&chr->hrs->hrm, notification,
+				MIN(sizeof(notification),
+					(size_t) mtu - ATT_NOTIFY_HDR_LEN));
+	if (len < 0)
+		return false;
+
+	/* Later changes are measured against what the central has seen */
+	chr->hrs->sent_hr = chr->hrs->hrm.hr;
+	chr->hrs->sent_contact = chr->hrs->hrm.contact;
+	chr->hrs->significant = false;
+	chr->hrs->pending = false;
+
+	return !chr_write(chr, notification, len, 0);
+}
+
+/**
+ * @brief This function is used to flag a heart rate as a significant change
+ * for the adaptive notification rate.
+ *
+ * @param hrs   A pointer to the service instance.
+ * @param hr    The heart rate in beats per minute.
+ */
+static void hrs_check_change(struct hr_service *hrs, unsigned int hr)
+{
+	unsigned int diff = hr > hrs->sent_hr ? hr - hrs->sent_hr :
+							hrs->sent_hr - hr;
+
+	if (diff >= hrs->hrp->adaptive_delta)
+		hrs->significant = true;
+}
+
+static void chr_notify_now(struct characteristic *chr);
+
+/**
+ * @brief This function is used to notify a significant change right away
+ * with the adaptive notification rate, rather than at the next tick of the
+ * backed-off timer.
+ *
+ * @param hrs   A pointer to the service instance.
+ */
+static void hrs_notify_significant(struct hr_service *hrs)
+{
+	if (!hrs->hrp->adaptive_enabled || !hrs->significant ||
+						hrs->hrp->applying_samples)
+		return;
+
+	if (!hrs->msrmt || !hrs->msrmt->notifying)
+		return;
+
+	chr_notify_now(hrs->msrmt);
+}
+
+/**
+ * @brief This function is used to update the heart rate reported by the next
+ * notification.
+ *
+ * @param hrp       A pointer to the context.
+ * @param index     The service instance number.
+ * @param hr        The heart rate in beats per minute.
+ * @param contact   Whether the sensor detects skin contact.
+ *
+ * @return 0 on success, -ENOENT if there is no such instance.
+ */
+int update_heart_rate(struct hrp *hrp, unsigned int index, uint16_t hr,
+								bool contact)
+{
+	struct hr_service *hrs = find_hr_service(hrp, index);
+
+	if (!hrs)
+		return -ENOENT;
+
+	hrs->hrm.hr = hr;
+	hrs->hrm.contact = contact;
+	hrs->pending = true;
+
+	if (contact != hrs->sent_contact)
+		hrs->significant = true;
+
+	hrs_check_change(hrs, hr);
+	hrs_notify_significant(hrs);
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to queue an RR-interval for the next
+ * notification. Intervals piling up between notifications are sent batched.
+ *
+ * @param hrp   A pointer to the context.
+ * @param index The service instance number.
+ * @param rr    The RR-interval in units of 1/1024 second.
+ *
+ * @return 0 on success, -ENOENT if there is no such instance.
+ */
+int queue_rr_interval(struct hrp *hrp, unsigned int index, uint16_t rr)
+{
+	struct hr_service *hrs = find_hr_service(hrp, index);
+
+	if (!hrs)
+		return -ENOENT;
+
+	hrm_queue_rr(&hrs->hrm, rr);
+	hrs->pending = true;
+
+	/* 60 * 1024 / rr is the heart rate of that beat */
+	if (rr)
+		hrs_check_change(hrs, 60 * 1024 / rr);
+
+	/* Send before a long keep-alive interval drops intervals */
+	if (hrs->hrm.rr_count > HRM_RR_QUEUE_LEN / 2)
+		hrs->significant = true;
+
+	hrs_notify_significant(hrs);
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to update the Energy Expended reported by the
+ * next notification and to keep it in the state file.
+ *
+ * @param hrp       A pointer to the context.
+ * @param index     The service instance number.
+ * @param energy    The accumulated energy in kilo Joules.
+ *
+ * @return 0 on success, -ENOENT if there is no such instance.
+ */
+int update_energy_expended(struct hrp *hrp, unsigned int index,
+							uint16_t energy)
+{
+	struct hr_service *hrs = find_hr_service(hrp, index);
+
+	if (!hrs)
+		return -ENOENT;
+
+	hrs_set_energy(hrs, energy * 1000);
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to add to the Energy Expended accumulator.
+ * Only the increment is applied, nothing is recomputed per notification.
+ *
+ * @param hrp       A pointer to the context.
+ * @param index     The service instance number.
+ * @param joules    The energy expended since the last call in Joules.
+ *
+ * @return 0 on success, -ENOENT if there is no such instance.
+ */
+int add_energy_expended(struct hrp *hrp, unsigned int index, uint16_t joules)
+{
+	struct hr_service *hrs = find_hr_service(hrp, index);
+
+	if (!hrs)
+		return -ENOENT;
+
+	hrs_set_energy(hrs, hrs->energy > UINT32_MAX - joules ? UINT32_MAX :
+							hrs->energy + joules);
+
+	return 0;
+}
+
+static gboolean notify_timeout_cb(gpointer user_data);
+
+/**
+ * @brief This function is used to (re)arm the notification timer.
+ *
+ * @param chr       A pointer to the characteristic structure.
+ * @param period    The period in milliseconds.
+ */
+static void chr_notify_arm(struct characteristic *chr, unsigned int period)
+{
+	if (chr->notify_timer)
+		g_source_remove(chr->notify_timer);
+
+	chr->notify_period = period;
+	chr->notify_timer = g_timeout_add_full(G_PRIORITY_DEFAULT, period,
+						notify_timeout_cb, chr, NULL);
+}
+
+/**
+ * @brief This function is used as the timer callback pushing samples while a
+ * characteristic is notifying.
+ *
+ * With the adaptive rate every tick without a significant change doubles
+ * the period up to the keep-alive interval, a significant one resets it.
+ *
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE to keep the timer running.
+ */
+static gboolean notify_timeout_cb(gpointer user_data)
+{
+	struct characteristic *chr = user_data;
+	struct hrp *hrp = chr->hrs->hrp;
+	bool changed = chr == chr->hrs->msrmt && chr->hrs->significant;
+	unsigned int period;
+
+	send_notification(chr);
+
+	if (!hrp->adaptive_enabled)
+		return TRUE;
+
+	if (changed)
+		period = hrp->notify_interval;
+	else
+		period = MIN(chr->notify_period * 2,
+				MAX(hrp->adaptive_keepalive,
+						hrp->notify_interval));
+
+	if (period == chr->notify_period)
+		return TRUE;
+
+	/* This source goes away with the FALSE below */
+	chr->notify_timer = 0;
+	chr_notify_arm(chr, period);
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to put a characteristic into notifying state
+ * and arm its notification timer. The first sample is sent right away.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ */
+static void chr_notify_start(struct characteristic *chr)
+{
+	struct hrp *hrp = chr->hrs->hrp;
+
+	if (chr->notifying)
+		return;
+
+	chr->notifying = true;
+	hrp->notifying = g_slist_prepend(hrp->notifying, chr);
+
+	chr_notify_arm(chr, hrp->notify_interval);
+
+	hrp_info("Characteristic(%s): notifying every %u ms", chr->uuid,
+							hrp->notify_interval);
+
+	object_property_changed(hrp->om, chr->path, GATT_CHR_IFACE,
+							"Notifying");
+
+	send_notification(chr);
+}
+
+/**
+ * @brief This function is used to leave notifying state and cancel the
+ * notification timer.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ */
+static void chr_notify_stop(struct characteristic *chr)
+{
+	struct hrp *hrp = chr->hrs->hrp;
+
+	if (!chr->notifying)
+		return;
+
+	if (chr->notify_timer)
+		g_source_remove(chr->notify_timer);
+
+	chr->notify_timer = 0;
+	chr->notifying = false;
+	hrp->notifying = g_slist_remove(hrp->notifying, chr);
+
+	hrp_info("Characteristic(%s): notification stopped", chr->uuid);
+
+	object_property_changed(hrp->om, chr->path, GATT_CHR_IFACE,
+							"Notifying");
+}
+
+/**
+ * @brief This function is used to send a notification right away and restart
+ * the notification timer, so the next periodic one is a full interval later.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ */
+static void chr_notify_now(struct characteristic *chr)
+{
+	chr_notify_arm(chr, chr->hrs->hrp->notify_interval);
+
+	send_notification(chr);
+}
+
+/**
+ * @brief This function is used as a callback when the sensor thread pushed
+ * samples. The whole batch goes into the sensor state before a single
+ * notification is sent on every notifying measurement characteristic whose
+ * instance got new data.
+ *
+ * @param ring      A pointer to the sample ring.
+ * @param user_data A pointer to the context.
+ */
+static void sample_ring_ready(struct sample_ring *ring, void *user_data)
+{
+	struct hrp *hrp = user_data;
+	const struct hr_sample *samples;
+	unsigned int count, total = 0;
+	GSList *l;
+
+	hrp->applying_samples = true;
+
+	while ((count = sample_ring_peek(ring, &samples))) {
+		unsigned int i, j;
+
+		for (i = 0; i < count; i++) {
+			const struct hr_sample *sample = &samples[i];
+
+			if (update_heart_rate(hrp, sample->sensor, sample->hr,
+							sample->contact))
+				continue;
+
+			for (j = 0; j < sample->rr_count &&
+						j < HR_SAMPLE_MAX_RR; j++)
+				queue_rr_interval(hrp, sample->sensor,
+							sample->rr[j]);
+
+			if (sample->energy)
+				add_energy_expended(hrp, sample->sensor,
+							sample->energy);
+		}
+
+		sample_ring_consume(ring, count);
+		total += count;
+	}
+
+	hrp->applying_samples = false;
+
+	if (!total)
+		return;
+
+	for (l = hrp->notifying; l; l = l->next) {
+		struct characteristic *chr = l->data;
+
+		if (chr != chr->hrs->msrmt || !chr->hrs->pending)
+			continue;
+
+		/* Steady values wait for the timer */
+		if (hrp->adaptive_enabled)
+			hrs_notify_significant(chr->hrs);
+		else
+			chr_notify_now(chr);
+	}
+}
+
+/**
+ * @brief This function is used to feed the heart rate service from a sample
+ * ring filled by the sensor acquisition thread.
+ *
+ * @param hrp   A pointer to the context.
+ * @param ring  A pointer to the sample ring.
+ *
+ * @return The source id, 0 on error.
+ */
+guint attach_sample_ring(struct hrp *hrp, struct sample_ring *ring)
+{
+	return sample_ring_attach(ring, sample_ring_ready, hrp);
+}
+
+/**
+ * @brief This function is used to stop the notifications of every
+ * characteristic and drop every device.
+ *
+ * @param hrp       A pointer to the context.
+ * @param forget    Whether to drop the devices from the state file too.
+ */
+static void reset_notifications(struct hrp *hrp, bool forget)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	while (hrp->notifying) {
+		struct characteristic *chr = hrp->notifying->data;
+
+		chr_release_notify_io(chr);
+		chr_notify_stop(chr);
+		chr->ccc_started = false;
+	}
+
+	/* Whoever was connected is gone along with bluetoothd */
+	if (hrp->devices) {
+		g_hash_table_iter_init(&iter, hrp->devices);
+
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct hrp_device *dev = value;
+			GSList *l;
+
+			for (l = dev->subscribed; l; l = l->next) {
+				struct characteristic *chr = l->data;
+
+				chr->subscribers = 0;
+				chr->sub_mtu = 0;
+			}
+
+			if (forget)
+				state_forget_device(hrp, dev->path);
+		}
+
+		g_hash_table_destroy(hrp->devices);
+		hrp->devices = NULL;
+	}
+}
+
+/**
+ * @brief This function is used to stop the notifications of every
+ * characteristic, e.g. when bluetoothd disconnects from the bus.
+ *
+ * @param hrp   A pointer to the context.
+ */
+void stop_notifications(struct hrp *hrp)
+{
+	reset_notifications(hrp, true);
+}
+
+/**
+ * @brief This function is used to create the socket pair handed out by
+ * AcquireNotify and AcquireWrite.
+ *
+ * Our end is wrapped in an unbuffered GIOChannel that closes the socket when
+ * the last reference is dropped.
+ *
+ * @param fd    A pointer to an integer that will be updated with the remote
+ *              end, to be passed to bluetoothd and closed by the caller.
+ *
+ * @return A pointer to GIOChannel for the local end or NULL on error.
+ */
+static GIOChannel *create_sock_io(int *fd)
+{
+	GIOChannel *io;
+	int fds[2];
+
+	if (socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0)
+		return NULL;
+
+	io = g_io_channel_unix_new(fds[0]);
+
+	g_io_channel_set_close_on_unref(io, TRUE);
+	g_io_channel_set_encoding(io, NULL, NULL);
+	g_io_channel_set_buffered(io, FALSE);
+
+	*fd = fds[1];
+
+	return io;
+}
+
+/**
+ * @brief This function is used as a callback when bluetoothd closes its end of
+ * the notification socket, e.g. when the last subscriber goes away.
+ *
+ * @param io        A pointer to GIOChannel.
+ * @param cond      The condition that triggered the callback.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return FALSE to remove the watch.
+ */
+static gboolean chr_notify_io_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct characteristic *chr = user_data;
+
+	hrp_info("Characteristic(%s): notify socket closed", chr->uuid);
+
+	chr->notify_watch = 0;
+	chr_release_notify_io(chr);
+	chr_notify_stop(chr);
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to handle the AcquireNotify D-Bus method call.
+ *
+ * It hands a SOCK_SEQPACKET socket back to the caller so that notifications
+ * are streamed as plain writes instead of PropertiesChanged signals.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The reply carrying the file descriptor and the MTU.
+ */
+static DBusMessage *chr_acquire_notify(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+	DBusMessageIter iter;
+	DBusMessage *reply;
+	struct attr_options opts = { .mtu = ATT_DEFAULT_LE_MTU };
+	int fd;
+
+	if (!chr_has_prop(chr, PROP_NOTIFY))
+		return g_dbus_create_error(msg, DBUS_ERROR_NOT_SUPPORTED,
+							"Not Supported");
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	if (parse_options(&iter, &opts))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	device_seen(chr->hrs->hrp, opts.device, opts.mtu);
+
+	if (chr->notify_io)
+		return g_dbus_create_error(msg, "org.bluez.Error.NotPermitted",
+							"Notify acquired");
+
+	chr->notify_io = create_sock_io(&fd);
+	if (!chr->notify_io)
+		return g_dbus_create_error(msg, "org.bluez.Error.Failed",
+							"%s", strerror(errno));
+
+	chr->notify_watch = g_io_add_watch(chr->notify_io,
+					G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+					chr_notify_io_cb, chr);
+	chr->mtu = opts.mtu;
+
+	reply = g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD, &fd,
+					DBUS_TYPE_UINT16, &chr->mtu,
+					DBUS_TYPE_INVALID);
+
+	close(fd);
+
+	hrp_info("Characteristic(%s): AcquireNotify, MTU %u", chr->uuid,
+								opts.mtu);
+
+	object_property_changed(chr->hrs->hrp->om, chr->path, GATT_CHR_IFACE,
+							"NotifyAcquired");
+
+	chr_notify_start(chr);
+
+	return reply;
+}
+
+/**
+ * @brief This function is used as a callback when data is available on the
+ * write socket handed out by AcquireWrite.
+ *
+ * Every datagram is one ATT write, it is read straight into a fixed buffer
+ * and passed to chr_write() without going through a DBusMessage.
+ *
+ * @param io        A pointer to GIOChannel.
+ * @param cond      The condition that triggered the callback.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE to keep the watch, FALSE once the socket is closed.
+ */
+static gboolean chr_write_io_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct characteristic *chr = user_data;
+	uint8_t buf[ATT_MAX_VALUE_LEN];
+	ssize_t len;
+	int fd;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		goto release;
+
+	fd = g_io_channel_unix_get_fd(io);
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		stats_inc(&chr->stats.writes);
+		chr_write(chr, buf, len, 0);
+	}
+
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return TRUE;
+
+release:
+	hrp_info("Characteristic(%s): write socket closed", chr->uuid);
+
+	chr->write_watch = 0;
+	chr_release_write_io(chr);
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to handle the AcquireWrite D-Bus method call.
+ *
+ * It hands a SOCK_SEQPACKET socket back to the caller so that writes arrive
+ * as datagrams on the main loop instead of WriteValue method calls.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The reply carrying the file descriptor and the MTU.
+ */
+static DBusMessage *chr_acquire_write(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+	DBusMessageIter iter;
+	DBusMessage *reply;
+	struct attr_options opts = { .mtu = ATT_DEFAULT_LE_MTU };
+	int fd;
+
+	if (!chr_write_acquired_exists(NULL, chr))
+		return g_dbus_create_error(msg, DBUS_ERROR_NOT_SUPPORTED,
+							"Not Supported");
+
+	if (!dbus_message_iter_init(msg, &iter))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	if (parse_options(&iter, &opts))
+		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
+							"Invalid arguments");
+
+	device_seen(chr->hrs->hrp, opts.device, opts.mtu);
+
+	if (chr->write_io)
+		return g_dbus_create_error(msg, "org.bluez.Error.NotPermitted",
+							"Write acquired");
+
+	chr->write_io = create_sock_io(&fd);
+	if (!chr->write_io)
+		return g_dbus_create_error(msg, "org.bluez.Error.Failed",
+							"%s", strerror(errno));
+
+	chr->write_watch = g_io_add_watch(chr->write_io,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				chr_write_io_cb, chr);
+	chr->mtu = opts.mtu;
+
+	reply = g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD, &fd,
+					DBUS_TYPE_UINT16, &chr->mtu,
+					DBUS_TYPE_INVALID);
+
+	close(fd);
+
+	hrp_info("Characteristic(%s): AcquireWrite, MTU %u", chr->uuid,
+								opts.mtu);
+
+	object_property_changed(chr->hrs->hrp->om, chr->path, GATT_CHR_IFACE,
+							"WriteAcquired");
+
+	return reply;
+}
+
+/**
+ * @brief This function is used to start the notification.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The function creates a new method return message using               
+ * dbus_message_new_method_return and return it.
+ */
+static DBusMessage *chr_start_notify(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	if (!chr_has_prop(chr, PROP_NOTIFY))
+		return g_dbus_create_error(msg, DBUS_ERROR_NOT_SUPPORTED,
+							"Not Supported");
+
+	chr_notify_start(chr);
+
+	return dbus_message_new_method_return(msg);
+}
+
+/**
+ * @brief This function is used to stop the notification.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return The function creates a new method return message using
+ * dbus_message_new_method_return and return it.
+ */
+static DBusMessage *chr_stop_notify(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	if (!chr->notifying)
+		return g_dbus_create_error(msg, "org.bluez.Error.Failed",
+							"Not notifying");
+
+	chr_notify_stop(chr);
+
+	return dbus_message_new_method_return(msg);
+}
+
+/**
+ * @brief represents the methods associated with the characteristic.
+ */
+static const GDBusMethodTable chr_methods[] = {
+	{ GDBUS_ASYNC_METHOD("ReadValue", GDBUS_ARGS({ "options", "a{sv}" }),
+					GDBUS_ARGS({ "value", "ay" }),
+					chr_read_value) },
+	{ GDBUS_ASYNC_METHOD("WriteValue", GDBUS_ARGS({ "value", "ay" },
+						{ "options", "a{sv}" }),
+					NULL, chr_write_value) },
+	{ GDBUS_ASYNC_METHOD("StartNotify", NULL, NULL, chr_start_notify) },
+	{ GDBUS_METHOD("StopNotify", NULL, NULL, chr_stop_notify) },
+	{ GDBUS_METHOD("AcquireNotify", GDBUS_ARGS({ "options", "a{sv}" }),
+					GDBUS_ARGS({ "fd", "h" }, { "mtu", "q" }),
+					chr_acquire_notify) },
+	{ GDBUS_METHOD("AcquireWrite", GDBUS_ARGS({ "options", "a{sv}" }),
+					GDBUS_ARGS({ "fd", "h" }, { "mtu", "q" }),
+					chr_acquire_write) },
+	{ }
 };
 
+/**
+ * @brief This function is used to start or stop notifications when the
+ * first device subscribes or the last one unsubscribes.
+ *
+ * Notifications started by StartNotify are left alone.
+ *
+ * @param chr   A pointer to the characteristic structure.
+ */
+static void chr_update_subscribers(struct characteristic *chr)
+{
+	chr_update_sub_mtu(chr);
+
+	if (chr->subscribers && !chr->notifying) {
+		chr->ccc_started = true;
+		chr_notify_start(chr);
+	} else if (!chr->subscribers && chr->ccc_started) {
+		chr->ccc_started = false;
+		chr_notify_stop(chr);
+	}
+}
+
+/**
+ * @brief This function is used to update the subscription of a device from
+ * a write to the Client Characteristic Configuration descriptor.
+ *
+ * @param path  The object path of the device, may be NULL.
+ * @param chr   A pointer to the characteristic the descriptor belongs to.
+ * @param value A pointer to the written CCC value.
+ * @param len   Length of the value.
+ */
+static void device_set_ccc(const char *path, struct characteristic *chr,
+					const uint8_t *value, int len)
+{
+	struct hrp_device *dev = device_lookup(chr->hrs->hrp, path, true);
+	bool enable = len > 0 && (value[0] & 0x03);
+	bool subscribed;
+
+	if (!dev)
+		return;
+
+	subscribed = g_slist_find(dev->subscribed, chr) != NULL;
+	if (enable == subscribed)
+		return;
+
+	if (enable) {
+		dev->subscribed = g_slist_prepend(dev->subscribed, chr);
+		chr->subscribers++;
+	} else {
+		dev->subscribed = g_slist_remove(dev->subscribed, chr);
+		chr->subscribers--;
+	}
+
+	hrp_info("Device %s: %s %s", dev->path,
+			enable ? "subscribed to" : "unsubscribed from",
+			chr->uuid);
+
+	state_save_ccc(dev, chr, enable);
+	chr_update_subscribers(chr);
+}
+
+/**
+ * @brief This function is used to drop all state of a device that
+ * disconnected.
+ *
+ * @param hrp   A pointer to the context.
+ * @param path  The object path of the device.
+ */
+void device_disconnected(struct hrp *hrp, const char *path)
+{
+	struct hrp_device *dev = device_lookup(hrp, path, false);
+	GSList *subscribed;
+
+	if (!dev)
+		return;
+
+	hrp_debug("Device %s: removed", dev->path);
+
+	state_forget_device(hrp, dev->path);
+
+	subscribed = dev->subscribed;
+	dev->subscribed = NULL;
+
+	g_hash_table_remove(hrp->devices, dev->path);
+
+	while (subscribed) {
+		struct characteristic *chr = subscribed->data;
+
+		chr->subscribers--;
+		chr_update_subscribers(chr);
+
+		subscribed = g_slist_delete_link(subscribed, subscribed);
+	}
+}
+
+/**
+ * @brief This function is used to put the subscriptions of one device back
+ * from the state file.
+ *
+ * The entry is released first and written again by device_set_ccc(), so
+ * subscriptions to characteristics that no longer exist are dropped.
+ *
+ * @param hrp   A pointer to the context.
+ * @param sd    A pointer to the state file entry of the device.
+ */
+static void restore_device(struct hrp *hrp, struct hrp_state_device *sd)
+{
+	static const uint8_t ccc[] = { 0x01, 0x00 };
+	struct hrp_state_device saved = *sd;
+	struct hrp_device *dev;
+	unsigned int i, j;
+
+	saved.path[HRP_STATE_PATH_LEN - 1] = '\0';
+	sd->path[0] = '\0';
+
+	device_seen(hrp, saved.path, saved.mtu);
+
+	for (i = 0; i < HRP_STATE_INSTANCES; i++) {
+		struct hr_service *hrs = find_hr_service(hrp, i);
+
+		for (j = 0; hrs && j < hrs->n_chrs; j++) {
+			struct characteristic *chr = hrs->chrs[j];
+
+			if (!(saved.ccc[i] & (1 << j)))
+				continue;
+
+			if (chr->desc) {
+				memcpy(chr->desc->value, ccc, sizeof(ccc));
+				chr->desc->vlen = sizeof(ccc);
+				invalidate_read_cache(&chr->desc->read_cache);
+			}
+
+			device_set_ccc(saved.path, chr, ccc, sizeof(ccc));
+		}
+	}
+
+	/* Until bluetoothd tells us it is still connected */
+	dev = device_lookup(hrp, saved.path, false);
+	if (dev)
+		dev->provisional = true;
+
+	hrp_info("Device %s: subscriptions restored", saved.path);
+}
+
+/**
+ * @brief This function is used to apply the state file to the services just
+ * created, before the application is registered with bluetoothd.
+ *
+ * Restores Body Sensor Location, Energy Expended and the CCC subscriptions
+ * of devices that were connected when the previous process exited.
+ *
+ * @param hrp   A pointer to the context.
+ */
+static void restore_state(struct hrp *hrp)
+{
+	struct hrp_state *state = hrp->state;
+	unsigned int i;
+
+	if (!state)
+		return;
+
+	for (i = 0; i < hrp->n_instances; i++) {
+		struct hr_service *hrs = hrp->instances[i];
+		struct hrp_state_instance *si = state_instance(hrs);
+
+		if (!si)
+			break;
+
+		if ((si->valid & HRP_STATE_LOCATION) && hrs->location) {
+			hrs->location->value[0] = si->location;
+			hrs->location->vlen = 1;
+			invalidate_read_cache(&hrs->location->read_cache);
+		}
+
+		if (si->valid & HRP_STATE_ENERGY)
+			hrs_set_energy(hrs, si->energy * 1000);
+	}
+
+	for (i = 0; i < HRP_STATE_DEVICES; i++) {
+		struct hrp_state_device *sd = &state->devices[i];
+
+		if (sd->path[0])
+			restore_device(hrp, sd);
+	}
+
+	state_sync(state);
+}
+
 /**                                                                             
  * @brief This function is used to handle D-Bus method call for reading         
  * the value of a descriptor                                  
@@ -688,24 +3198,44 @@ static DBusMessage *desc_read_value(DBusConnection *conn, DBusMessage *msg,
 	struct descriptor *desc = user_data;
 	DBusMessage *reply;
 	DBusMessageIter iter;
-	const char *device;
+	struct attr_options opts = { .device = NULL };
+	int len;
 
 	if (!dbus_message_iter_init(msg, &iter))
 		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
 							"Invalid arguments");
 
-	if (parse_options(&iter, &device))
+	if (parse_options(&iter, &opts))
 		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
 							"Invalid arguments");
 
-	reply = dbus_message_new_method_return(msg);
-	if (!reply)
-		return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
+	device_seen(desc->chr->hrs->hrp, opts.device, opts.mtu);
+
+	if (opts.offset > desc->vlen)
+		return g_dbus_create_error(msg, "org.bluez.Error.InvalidOffset",
+							"Invalid offset");
+
+	/* Only the plain read of the whole value is worth caching */
+	len = read_len(desc->vlen, &opts);
+	if (opts.offset || len < desc->vlen)
+		return read_slice_reply(msg, desc->value + opts.offset, len);
+
+	if (!desc->read_cache) {
+		desc->read_cache = dbus_message_new(
+					DBUS_MESSAGE_TYPE_METHOD_RETURN);
+		if (!desc->read_cache)
+			return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
 							"No Memory");
 
-	dbus_message_iter_init_append(reply, &iter);
+		dbus_message_iter_init_append(desc->read_cache, &iter);
 
-	desc_read(desc, &iter);
+		desc_read(desc, &iter);
+	}
+
+	reply = reply_from_cache(desc->read_cache, msg);
+	if (!reply)
+		return g_dbus_create_error(msg, DBUS_ERROR_NO_MEMORY,
+							"No Memory");
 
 	return reply;
 }
@@ -725,10 +3255,11 @@ static DBusMessage *desc_write_value(DBusConnection *conn, DBusMessage *msg,
 							void *user_data)
 {
 	struct descriptor *desc = user_data;
+	struct hrp *hrp = desc->chr->hrs->hrp;
 	DBusMessageIter iter;
-	const char *device;
+	struct attr_options opts = { .device = NULL };
 	const uint8_t *value;
-	int len;
+	int len, err;
 
 	if (!dbus_message_iter_init(msg, &iter))
 		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
@@ -738,114 +3269,427 @@ static DBusMessage *desc_write_value(DBusConnection *conn, DBusMessage *msg,
 		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
 							"Invalid arguments");
 
-	if (parse_options(&iter, &device))
+	if (parse_options(&iter, &opts))
 		return g_dbus_create_error(msg, DBUS_ERROR_INVALID_ARGS,
 							"Invalid arguments");
 
-	desc_write(conn, desc, value, len);
+	device_seen(hrp, opts.device, opts.mtu);
+
+	if (opts.prepare_authorize)
+		return dbus_message_new_method_return(msg);
+
+	hrp->write_msg = msg;
+	err = desc_write(desc, value, len, opts.offset);
+	hrp->write_msg = NULL;
+
+	if (err)
+		return write_error(msg, err);
+
+	if (desc->uuid == intern_uuid(CLIENT_CHR_CONFIG_DESCRIPTOR_UUID))
+		device_set_ccc(opts.device, desc->chr, desc->value,
+								desc->vlen);
+
+	return dbus_message_new_method_return(msg);
+}
+
+/**                                                                             
+ * @brief represents the methods associated with the characteristic.            
+ */     
+static const GDBusMethodTable desc_methods[] = {
+	{ GDBUS_ASYNC_METHOD("ReadValue", GDBUS_ARGS({ "options", "a{sv}" }),
+					GDBUS_ARGS({ "value", "ay" }),
+					desc_read_value) },
+	{ GDBUS_ASYNC_METHOD("WriteValue", GDBUS_ARGS({ "value", "ay" },
+						{ "options", "a{sv}" }),
+					NULL, desc_write_value) },
+	{ }
+};
+
+/**
+ * @brief This function is used to append a statistics counter to a property
+ * reply.
+ *
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param counter   A pointer to the counter.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_append_counter(DBusMessageIter *iter,
+					const atomic_uint_fast64_t *counter)
+{
+	dbus_uint64_t value = atomic_load_explicit(counter,
+						memory_order_relaxed);
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &value);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used to append a histogram to a property reply.
+ *
+ * @param iter  A pointer to DBusMessageIter structure.
+ * @param hist  The histogram buckets.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_append_histogram(DBusMessageIter *iter,
+					const atomic_uint_fast64_t *hist)
+{
+	DBusMessageIter array;
+	unsigned int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "t", &array);
+
+	for (i = 0; i < HRP_STATS_BUCKETS; i++)
+		stats_append_counter(&array, &hist[i]);
+
+	dbus_message_iter_close_container(iter, &array);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Writes property of the statistics.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_writes(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_counter(iter, &chr->stats.writes);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Reads property of the statistics.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_reads(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_counter(iter, &chr->stats.reads);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Notifications property of the statistics.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_notifications(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_counter(iter, &chr->stats.notifications);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Errors property of the statistics.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_errors(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_counter(iter, &chr->stats.errors);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Drops property, notifications the queue policy dropped.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_drops(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_counter(iter, &chr->stats.drops);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the HandlerTime property, the total time spent in method handlers in
+ * nanoseconds.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_handler_time(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_counter(iter, &chr->stats.handler_ns);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Elapsed property, the nanoseconds since the counters were reset.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_elapsed(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+	dbus_uint64_t elapsed = stats_now() - chr->stats.since;
+
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &elapsed);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the Latency property, the histogram of the time from a value being
+ * written until it was notified.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_latency(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_histogram(iter, chr->stats.latency);
+}
+
+/**
+ * @brief This function is used as a callback to handle property access request
+ * for the HandlerLatency property, the histogram of method handler times.
+ *
+ * @param property  A pointer to GDBusPropertyTable structure.
+ * @param iter      A pointer to DBusMessageIter structure.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return TRUE indicate the property value retrieval was successful.
+ */
+static gboolean stats_get_handler_latency(const GDBusPropertyTable *property,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	return stats_append_histogram(iter, chr->stats.handler);
+}
+
+/**
+ * @brief represents the properties of the statistics interface. None of
+ * them emit PropertiesChanged, clients poll them.
+ */
+static const GDBusPropertyTable stats_properties[] = {
+	{ "Writes", "t", stats_get_writes },
+	{ "Reads", "t", stats_get_reads },
+	{ "Notifications", "t", stats_get_notifications },
+	{ "Errors", "t", stats_get_errors },
+	{ "Drops", "t", stats_get_drops },
+	{ "HandlerTime", "t", stats_get_handler_time },
+	{ "Elapsed", "t", stats_get_elapsed },
+	{ "Latency", "at", stats_get_latency },
+	{ "HandlerLatency", "at", stats_get_handler_latency },
+	{ }
+};
+
+/**
+ * @brief This function is used to handle the Reset method of the statistics
+ * interface.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param msg       A pointer to DBusMessage.
+ * @param user_data A pointer to the characteristic structure.
+ *
+ * @return An empty method return.
+ */
+static DBusMessage *stats_reset_method(DBusConnection *conn, DBusMessage *msg,
+							void *user_data)
+{
+	struct characteristic *chr = user_data;
+
+	stats_reset(&chr->stats);
+
+	return dbus_message_new_method_return(msg);
+}
+
+/**
+ * @brief represents the methods of the statistics interface.
+ */
+static const GDBusMethodTable stats_methods[] = {
+	{ GDBUS_METHOD("Reset", NULL, NULL, stats_reset_method) },
+	{ }
+};
+
+/**
+ * @brief This function is used to print the statistics of every
+ * characteristic of every service instance.
+ *
+ * @param hrp   A pointer to the context.
+ */
+void dump_stats(struct hrp *hrp)
+{
+	unsigned int i;
 
-	return dbus_message_new_method_return(msg);
-}
+	for (i = 0; i < hrp->n_instances; i++) {
+		struct hr_service *hrs = hrp->instances[i];
+		unsigned int j;
 
-/**                                                                             
- * @brief represents the methods associated with the characteristic.            
- */     
-static const GDBusMethodTable desc_methods[] = {
-	{ GDBUS_ASYNC_METHOD("ReadValue", GDBUS_ARGS({ "options", "a{sv}" }),
-					GDBUS_ARGS({ "value", "ay" }),
-					desc_read_value) },
-	{ GDBUS_ASYNC_METHOD("WriteValue", GDBUS_ARGS({ "value", "ay" },
-						{ "options", "a{sv}" }),
-					NULL, desc_write_value) },
-	{ }
-};
+		for (j = 0; j < hrs->n_chrs; j++)
+			stats_dump(hrs->chrs[j]->path, &hrs->chrs[j]->stats);
+	}
+}
 
 /**
  * @brief This function is used to register a GATT characteristic and a optional
- * descriptors on a D-Bus connection
+ * descriptors on the connection of the instance's context
  *
- * @param connection        A pointer to DBusConnection.
+ * @param hrs               A pointer to the service instance owning the chr.
+ * @param service           The object path of the GATT service.
  * @param chr_uuid          A srting representing the UUID of chr.
  * @param value             A pointer to byte array representing the value of chr.
  * @param vlen              An int representing the length of the byte array.
  * @param props             A pointer to array of strings.
  * @param desc_uuid         A string representing the UUID of desc.
  * @param desc_props        A pointer to array of strings.
- * @param service_path      A string representing the D-Bus object path.
  *
- * @return This function will return TRUE indicating the registration successful.
+ * @return This function will return the registered characteristic or NULL.
  */
-static gboolean register_characteristic(DBusConnection *connection, 
-                        const char *chr_uuid,
+static struct characteristic *register_characteristic(
+						struct hr_service *hrs,
+						const char *service,
+						const char *chr_uuid,
 						const uint8_t *value, int vlen,
 						const char **props,
 						const char *desc_uuid,
-						const char **desc_props,
-						const char *service_path)
+						const char **desc_props)
 {
+	struct hrp *hrp = hrs->hrp;
 	struct characteristic *chr;
 	struct descriptor *desc;
-	static int id = 1;
 
-	chr = g_new0(struct characteristic, 1);
-	chr->uuid = g_strdup(chr_uuid);
-	chr->value = util_memdup(value, vlen);
+	chr = arena_alloc(hrs->arena, sizeof(*chr));
+	chr->uuid = intern_uuid(chr_uuid);
+	if (vlen > ATT_MAX_VALUE_LEN)
+		vlen = ATT_MAX_VALUE_LEN;
+
+	memcpy(chr->value, value, vlen);
 	chr->vlen = vlen;
 	chr->props = props;
-	chr->service = g_strdup(service_path);
-	chr->path = g_strdup_printf("%s/characteristic%d", service_path, id++);
-
-	if (!g_dbus_register_interface(connection, chr->path, GATT_CHR_IFACE,
+	chr->flags = props_to_mask(props);
+	chr->service = service;
+	chr->hrs = hrs;
+	chr->coalesce = uuid_coalesces(hrp, chr->uuid);
+	chr->path = arena_printf(hrs->arena, "%s/characteristic%u", service,
+							hrs->next_id++);
+
+	if (!object_register(hrp->om, chr->path, GATT_CHR_IFACE,
 					chr_methods, NULL, chr_properties,
 					chr, chr_iface_destroy)) {
-		printf("Couldn't register characteristic interface\n");
+		hrp_error("Couldn't register characteristic interface");
 		chr_iface_destroy(chr);
-		return FALSE;
+		return NULL;
 	}
 
+	stats_reset(&chr->stats);
+
+	/*
+	 * Statistics are best effort, the characteristic works without them.
+	 * They change with every request, so they stay out of the cached
+	 * GetManagedObjects reply and are only read with Get/GetAll.
+	 */
+	if (!g_dbus_register_interface(hrp->conn, chr->path, HRP_STATS_IFACE,
+					stats_methods, NULL, stats_properties,
+					chr, NULL))
+		hrp_warn("Couldn't register statistics interface");
+
 	if (!desc_uuid)
-		return TRUE;
+		return chr;
 
-	desc = g_new0(struct descriptor, 1);
-	desc->uuid = g_strdup(desc_uuid);
+	desc = arena_alloc(hrs->arena, sizeof(*desc));
+	desc->uuid = intern_uuid(desc_uuid);
 	desc->chr = chr;
 	desc->props = desc_props;
-	desc->path = g_strdup_printf("%s/descriptor%d", chr->path, id++);
+	desc->coalesce = uuid_coalesces(hrp, desc->uuid);
+	desc->path = arena_printf(hrs->arena, "%s/descriptor%u", chr->path,
+							hrs->next_id++);
 
-	if (!g_dbus_register_interface(connection, desc->path,
+	if (!object_register(hrp->om, desc->path,
 					GATT_DESCRIPTOR_IFACE,
 					desc_methods, NULL, desc_properties,
 					desc, desc_iface_destroy)) {
-		printf("Couldn't register descriptor interface\n");
-		g_dbus_unregister_interface(connection, chr->path,
-							GATT_CHR_IFACE);
+		hrp_error("Couldn't register descriptor interface");
+		g_dbus_unregister_interface(hrp->conn, chr->path,
+							HRP_STATS_IFACE);
+		object_unregister(hrp->om, chr->path, GATT_CHR_IFACE);
 
-		desc_iface_destroy(desc);
-		return FALSE;
+		return NULL;
 	}
 
-	return TRUE;
+	chr->desc = desc;
+
+	return chr;
 }
 
 /**
  * @brief This function is used to register a GATT service on a D-Bus connection.
  *
- * @param connection    A pointer to DBusConnection.
+ * @param hrs           A pointer to the service instance.
+ * @param path_fmt      The object path, %u is the instance number.
  * @param uuid          A string representing the service UUID
  *
  * @return  This function will returns the dynamically generated path for the service.
  */
-static char *register_service(DBusConnection *connection, const char *uuid)
+static char *register_service(struct hr_service *hrs, const char *path_fmt,
+							const char *uuid)
 {
-	static int id = 1;
 	char *path;
 
-	path = g_strdup_printf("/service%d", id++);
-	if (!g_dbus_register_interface(connection, path, GATT_SERVICE_IFACE,
+	path = arena_printf(hrs->arena, path_fmt, hrs->index + 1);
+	if (!object_register(hrs->hrp->om, path, GATT_SERVICE_IFACE,
 				NULL, NULL, service_properties,
-				g_strdup(uuid), g_free)) {
-		printf("Couldn't register service interface\n");
-		g_free(path);
+				(void *) intern_uuid(uuid), NULL)) {
+		hrp_error("Couldn't register service interface");
 		return NULL;
 	}
 
@@ -853,62 +3697,322 @@ static char *register_service(DBusConnection *connection, const char *uuid)
 }
 
 /**
- * @brief This function is used to create andregister a set of GATT services,
- * along with their characteristics and descriptors on a D-Bus connection.
+ * @brief This function is used to unregister a characteristic and its
+ * descriptor.
  *
- * @param connection    A pointer to DBusConnection.
+ * @param chr           A pointer to the characteristic, may be NULL.
  */
-void create_services_one(DBusConnection *connection)
+static void unregister_characteristic(struct characteristic *chr)
 {
-	char *service_path;
-	uint8_t level = 0;
+	struct hrp *hrp;
 
-	service_path = register_service(connection, HRP_UUID);
-	if (!service_path)
+	if (!chr)
 		return;
 
-	/* Add Heart rate measurement characteristic to Heart rate service */
-	if (!register_characteristic(connection, HR_MSRMT_CHR_UUID,
-						&level, sizeof(level),
-					    hrs_hr_msrmt_props,
-						CLIENT_CHR_CONFIG_DESCRIPTOR_UUID,
-						ccc_desc_props,
-						service_path)) {
-		printf("Couldn't Heart rate measurement characteristic (HRS)\n");
-		g_dbus_unregister_interface(connection, service_path,
+	hrp = chr->hrs->hrp;
+
+	devices_forget_chr(chr);
+
+	if (chr->desc)
+		object_unregister(hrp->om, chr->desc->path,
+							GATT_DESCRIPTOR_IFACE);
+
+	g_dbus_unregister_interface(hrp->conn, chr->path, HRP_STATS_IFACE);
+	object_unregister(hrp->om, chr->path, GATT_CHR_IFACE);
+}
+
+/**
+ * @brief This function is used to unregister a service instance and release
+ * all of its memory in one go.
+ *
+ * @param hrs           A pointer to the service instance.
+ */
+static void destroy_hr_service(struct hr_service *hrs)
+{
+	/* Undo the registration in reverse, however far it got */
+	while (hrs->n_chrs)
+		unregister_characteristic(hrs->chrs[--hrs->n_chrs]);
+
+	while (hrs->n_paths)
+		object_unregister(hrs->hrp->om, hrs->paths[--hrs->n_paths],
 							GATT_SERVICE_IFACE);
-		g_free(service_path);
-		return;
+
+	arena_free(hrs->arena);
+}
+
+/**
+ * @struct chr_init
+ * Represents the parts of a characteristic definition the configuration
+ * can override
+ */
+struct chr_init {
+	const uint8_t *value;
+	int vlen;
+	const char **props;
+};
+
+/**
+ * @struct chr_def
+ * Represents one characteristic of a static service description
+ */
+struct chr_def {
+	const char *uuid;
+	const char **props;
+	const uint8_t *value;
+	int vlen;
+	const char *desc_uuid;
+	const char **desc_props;
+	/* Offset of the struct hr_service pointer to set, -1 for none */
+	ptrdiff_t slot;
+	void (*configure)(struct chr_init *init,
+					const struct hrs_config *config);
+};
+
+/**
+ * @struct service_def
+ * Represents a static service description
+ */
+struct service_def {
+	const char *uuid;
+	const char *path_fmt;
+	/* Offset of the bool in struct hrs_config enabling it, -1 for always */
+	ptrdiff_t enable;
+	const struct chr_def *chrs;
+	unsigned int n_chrs;
+};
+
+/**
+ * @brief This function is used to apply the configured Body Sensor Location.
+ *
+ * @param init      A pointer to the characteristic to be registered.
+ * @param config    A pointer to the instance configuration.
+ */
+static void configure_location(struct chr_init *init,
+					const struct hrs_config *config)
+{
+	init->value = &config->location;
+	init->vlen = sizeof(config->location);
+}
+
+/**
+ * @brief This function is used to apply the configured write properties of
+ * the Heart Rate Control Point.
+ *
+ * @param init      A pointer to the characteristic to be registered.
+ * @param config    A pointer to the instance configuration.
+ */
+static void configure_ctrl_pt(struct chr_init *init,
+					const struct hrs_config *config)
+{
+	if (config->ctrl_pt_write_without_response)
+		init->props = hrs_hr_ctrl_pt_wwr_props;
+}
+
+static const uint8_t zero_value[] = { 0x00 };
+static const uint8_t battery_level_value[] = { 100 };
+static const uint8_t manufacturer_value[] = "hrp_profile";
+static const uint8_t model_value[] = "HRP-1";
+
+static const struct chr_def hrs_chrs[] = {
+	{ HR_MSRMT_CHR_UUID, hrs_hr_msrmt_props,
+		zero_value, sizeof(zero_value),
+		CLIENT_CHR_CONFIG_DESCRIPTOR_UUID, ccc_desc_props,
+		offsetof(struct hr_service, msrmt), NULL },
+	{ BODY_SENSOR_LOC_CHR_UUID, hrs_body_sensor_loc_props,
+		zero_value, sizeof(zero_value), NULL, NULL,
+		offsetof(struct hr_service, location), configure_location },
+	{ HR_CTRL_PT_CHR_UUID, hrs_hr_ctrl_pt_props,
+		zero_value, sizeof(zero_value), NULL, NULL,
+		offsetof(struct hr_service, ctrl_pt), configure_ctrl_pt },
+};
+
+static const struct chr_def battery_chrs[] = {
+	{ BATTERY_LEVEL_CHR_UUID, battery_level_props,
+		battery_level_value, sizeof(battery_level_value),
+		CLIENT_CHR_CONFIG_DESCRIPTOR_UUID, ccc_desc_props, -1, NULL },
+};
+
+/* Strings go out without their terminating NUL */
+static const struct chr_def device_info_chrs[] = {
+	{ MANUFACTURER_NAME_CHR_UUID, device_info_props,
+		manufacturer_value, sizeof(manufacturer_value) - 1,
+		NULL, NULL, -1, NULL },
+	{ MODEL_NUMBER_CHR_UUID, device_info_props,
+		model_value, sizeof(model_value) - 1,
+		NULL, NULL, -1, NULL },
+};
+
+/* Services registered per instance, the Heart Rate Service comes first */
+static const struct service_def service_defs[] = {
+	{ HRP_UUID, "/service%u", -1,
+		hrs_chrs, G_N_ELEMENTS(hrs_chrs) },
+	{ BATTERY_UUID, "/battery%u", offsetof(struct hrs_config, battery),
+		battery_chrs, G_N_ELEMENTS(battery_chrs) },
+	{ DEVICE_INFO_UUID, "/devinfo%u",
+		offsetof(struct hrs_config, device_info),
+		device_info_chrs, G_N_ELEMENTS(device_info_chrs) },
+};
+
+/* Every instance records one path per service in hrs->paths */
+G_STATIC_ASSERT(G_N_ELEMENTS(service_defs) <= HRS_MAX_SERVICES);
+
+/**
+ * @brief This function is used to register one service of an instance from
+ * its static description.
+ *
+ * On failure whatever was registered stays recorded in the instance, so
+ * destroy_hr_service() can roll it back.
+ *
+ * @param hrs           A pointer to the service instance.
+ * @param def           A pointer to the service description.
+ * @param config        A pointer to the instance configuration.
+ *
+ * @return 0 on success, -EIO if an interface could not be registered,
+ * -ENOSPC if the instance has no room for another characteristic.
+ */
+static int register_service_def(struct hr_service *hrs,
+					const struct service_def *def,
+					const struct hrs_config *config)
+{
+	unsigned int i;
+	char *path;
+
+	path = register_service(hrs, def->path_fmt, def->uuid);
+	if (!path)
+		return -EIO;
+
+	hrs->paths[hrs->n_paths++] = path;
+
+	for (i = 0; i < def->n_chrs; i++) {
+		const struct chr_def *cd = &def->chrs[i];
+		struct chr_init init = { cd->value, cd->vlen, cd->props };
+		struct characteristic *chr;
+
+		if (hrs->n_chrs == HRS_MAX_CHRS)
+			return -ENOSPC;
+
+		if (cd->configure)
+			cd->configure(&init, config);
+
+		chr = register_characteristic(hrs, path, cd->uuid,
+						init.value, init.vlen,
+						init.props, cd->desc_uuid,
+						cd->desc_props);
+		if (!chr) {
+			hrp_error("Couldn't register characteristic %s",
+								cd->uuid);
+			return -EIO;
+		}
+
+		chr->index = hrs->n_chrs;
+		hrs->chrs[hrs->n_chrs++] = chr;
+
+		if (cd->slot >= 0)
+			*(struct characteristic **) ((char *) hrs +
+							cd->slot) = chr;
 	}
 
-	if (!register_characteristic(connection, BODY_SENSOR_LOC_CHR_UUID,                             
-	                    &level, sizeof(level),                                  
-	                    hrs_body_sensor_loc_props,                                     
-	                    NULL,                      
-	                    NULL,                                         
-	                    service_path)) {                                        
-	     printf("Couldn't register body sensor location characteristic (HRS)\n");         
-	     g_dbus_unregister_interface(connection, service_path,                   
-	                         GATT_SERVICE_IFACE);                                
-	     g_free(service_path);                                                   
-	     return;                                                                 
-	}                
+	return 0;
+}
+
+/**
+ * @brief This function is used to create and register one Heart Rate Service
+ * instance along with the optional services configured for it.
+ *
+ * @param hrp           A pointer to the context.
+ * @param index         The instance number.
+ * @param config        A pointer to the instance configuration.
+ *
+ * @return A pointer to the service instance or NULL on error.
+ */
+static struct hr_service *create_hr_service(struct hrp *hrp,
+					unsigned int index,
+					const struct hrs_config *config)
+{
+	struct arena *arena;
+	struct hr_service *hrs;
+	unsigned int i;
+
+	arena = arena_new(0);
+
+	hrs = arena_alloc(arena, sizeof(*hrs));
+	hrs->arena = arena;
+	hrs->hrp = hrp;
+	hrs->index = index;
+	hrs->next_id = 1;
+	hrs->hrm.contact_supported = config->contact_supported;
+
+	for (i = 0; i < G_N_ELEMENTS(service_defs); i++) {
+		const struct service_def *def = &service_defs[i];
+
+		if (def->enable >= 0 &&
+				!*(const bool *) ((const char *) config +
+								def->enable))
+			continue;
+
+		if (register_service_def(hrs, def, config))
+			goto fail;
+	}
+
+	hrs->path = hrs->paths[0];
+
+	return hrs;
+
+fail:
+	destroy_hr_service(hrs);
+	return NULL;
+}
+
+/**
+ * @brief This function is used to create and register a number of independent
+ * Heart Rate Service instances. They all live below "/" and are therefore
+ * exposed by a single RegisterApplication.
+ *
+ * @param hrp           A pointer to the context.
+ * @param count         Number of instances to create.
+ * @param config        A pointer to the configuration shared by all instances,
+ *                      NULL for the defaults.
+ *
+ * @return The number of instances created.
+ */
+static unsigned int create_services(struct hrp *hrp, unsigned int count,
+					const struct hrs_config *config)
+{
+	static const struct hrs_config default_config;
+	unsigned int i;
+
+	if (!config)
+		config = &default_config;
+
+	hrp->instances = g_renew(struct hr_service *, hrp->instances,
+						hrp->n_instances + count);
+
+	for (i = 0; i < count; i++) {
+		struct hr_service *hrs;
+
+		hrs = create_hr_service(hrp, hrp->n_instances, config);
+		if (!hrs)
+			break;
+
+		hrp->instances[hrp->n_instances++] = hrs;
+		hrp_info("Registered service: %s", hrs->path);
+	}
+
+	return i;
+}
 
-    if (!register_characteristic(connection, HR_CTRL_PT_CHR_UUID,                             
-                        &level, sizeof(level),                                  
-                        hrs_hr_ctrl_pt_props,                                     
-                        NULL,                      
-                        NULL,                                         
-                        service_path)) {                                        
-       printf("Couldn't register Heart rate control point characteristic (HRS)\n");         
-       g_dbus_unregister_interface(connection, service_path,                   
-                             GATT_SERVICE_IFACE);                                
-       g_free(service_path);                                                   
-       return;                                                                 
-    }                
+/**
+ * @brief This function is used to unregister and free all service instances.
+ *
+ * @param hrp           A pointer to the context.
+ */
+static void remove_services(struct hrp *hrp)
+{
+	while (hrp->n_instances)
+		destroy_hr_service(hrp->instances[--hrp->n_instances]);
 
-	services = g_slist_prepend(services, service_path);
-	printf("Registered service: %s\n", service_path);
+	g_free(hrp->instances);
+	hrp->instances = NULL;
 }
 
 /**
@@ -916,19 +4020,22 @@ void create_services_one(DBusConnection *connection)
  * RegisterApplication D-Bus method call.
  *
  * @param reply     A pointer to DBusMessage.
- * @param user_data A pointer to user defined data.
+ * @param user_data A pointer to the context.
  */
 static void register_app_reply(DBusMessage *reply, void *user_data)
 {
+	struct hrp *hrp = user_data;
+	uint64_t elapsed = (stats_now() - hrp->register_app_start) / 1000;
 	DBusError derr;
 
 	dbus_error_init(&derr);
 	dbus_set_error_from_message(&derr, reply);
 
 	if (dbus_error_is_set(&derr))
-		printf("RegisterApplication: %s\n", derr.message);
+		hrp_error("RegisterApplication: %s", derr.message);
 	else
-		printf("RegisterApplication: OK\n");
+		hrp_info("RegisterApplication: OK after %llu us",
+					(unsigned long long) elapsed);
 
 	dbus_error_free(&derr);
 }
@@ -947,10 +4054,8 @@ static void register_app_setup(DBusMessageIter *iter, void *user_data)
 
 	dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH, &path);
 
+	/* GattManager1 defines no options, the dictionary stays empty */
 	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
-
-	/* TODO: Add options dictionary */
-
 	dbus_message_iter_close_container(iter, &dict);
 }
 
@@ -958,17 +4063,321 @@ static void register_app_setup(DBusMessageIter *iter, void *user_data)
  * @brief This function is used to make method call to the RegisterAplication
  * method on a GDBusProxy object.
  *
+ * @param hrp       A pointer to the context.
  * @param proxy     A pointer to GDBusProxy object representing the D-Bus proxy.
  */
-void register_app(GDBusProxy *proxy)
+static void register_app(struct hrp *hrp, GDBusProxy *proxy)
 {
+	hrp->register_app_start = stats_now();
+
 	if (!g_dbus_proxy_method_call(proxy, "RegisterApplication",
 					register_app_setup, register_app_reply,
-					NULL, NULL)) {
-		printf("Unable to call RegisterApplication\n");
+					hrp, NULL)) {
+		hrp_error("Unable to call RegisterApplication");
+		return;
+	}
+}
+
+/**
+ * @brief This function is used to tell whether a proxy is a Device1 object.
+ *
+ * @param proxy     A pointer to GDBusProxy object.
+ *
+ * @return true for org.bluez.Device1 proxies.
+ */
+static bool is_device_proxy(GDBusProxy *proxy)
+{
+	static GQuark device;
+	const char *iface;
+
+	if (!device)
+		device = g_quark_from_static_string(DEVICE_IFACE);
+
+	iface = g_dbus_proxy_get_interface(proxy);
+
+	return iface && g_quark_try_string(iface) == device;
+}
+
+/**
+ * @brief This function is used to confirm a device restored from the state
+ * file, or to drop it if bluetoothd reports it as not connected.
+ *
+ * @param hrp       A pointer to the context.
+ * @param proxy     A pointer to the Device1 proxy.
+ */
+static void device_proxy_added(struct hrp *hrp, GDBusProxy *proxy)
+{
+	const char *path = g_dbus_proxy_get_path(proxy);
+	struct hrp_device *dev = device_lookup(hrp, path, false);
+	dbus_bool_t connected = FALSE;
+	DBusMessageIter iter;
+
+	if (!dev || !dev->provisional)
+		return;
+
+	if (g_dbus_proxy_get_property(proxy, "Connected", &iter) &&
+			dbus_message_iter_get_arg_type(&iter) ==
+							DBUS_TYPE_BOOLEAN)
+		dbus_message_iter_get_basic(&iter, &connected);
+
+	if (!connected) {
+		hrp_info("Device %s: no longer connected", path);
+		device_disconnected(hrp, path);
+		return;
+	}
+
+	dev->provisional = false;
+	hrp_debug("Device %s: still connected", path);
+}
+
+/**
+ * @brief This function is used as a callback once the client has seen every
+ * object bluetoothd had. Restored devices it did not report are gone.
+ *
+ * @param client    A pointer to the GDBusClient.
+ * @param user_data A pointer to the context.
+ */
+static void client_ready_cb(GDBusClient *client, void *user_data)
+{
+	struct hrp *hrp = user_data;
+	GHashTableIter iter;
+	gpointer value;
+	GSList *gone = NULL;
+
+	if (!hrp->devices)
+		return;
+
+	g_hash_table_iter_init(&iter, hrp->devices);
+
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct hrp_device *dev = value;
+
+		if (dev->provisional)
+			gone = g_slist_prepend(gone, g_strdup(dev->path));
+	}
+
+	while (gone) {
+		hrp_info("Device %s: unknown to bluetoothd",
+						(char *) gone->data);
+		device_disconnected(hrp, gone->data);
+
+		g_free(gone->data);
+		gone = g_slist_delete_link(gone, gone);
+	}
+}
+
+/**
+ * @brief This function is used as a callback for proxy-added signal when a new
+ * GDBusProxy object is added.
+ *
+ * @param proxy     A pointer to GSBusProxy object.
+ * @param user_data A pointer to the context.
+ */
+static void proxy_added_cb(GDBusProxy *proxy, void *user_data)
+{
+	static GQuark gatt_mgr;
+	struct hrp *hrp = user_data;
+	const char *iface;
+
+	if (is_device_proxy(proxy)) {
+		device_proxy_added(hrp, proxy);
+		return;
+	}
+
+	if (!gatt_mgr)
+		gatt_mgr = g_quark_from_static_string(GATT_MGR_IFACE);
+
+	iface = g_dbus_proxy_get_interface(proxy);
+
+	/* Interfaces we never saw as a quark can't be GATT_MGR_IFACE */
+	if (!iface || g_quark_try_string(iface) != gatt_mgr)
+		return;
+
+	if (hrp->adapter && strcmp(g_dbus_proxy_get_path(proxy), hrp->adapter))
+		return;
+
+	hrp_info("%s on %s after %llu us", GATT_MGR_IFACE,
+			g_dbus_proxy_get_path(proxy),
+			(unsigned long long) (stats_now() - hrp->started) / 1000);
+
+	register_app(hrp, proxy);
+}
+
+/**
+ * @brief This function is used as a callback for proxy-removed signal, a
+ * device that goes away loses its subscriptions.
+ *
+ * @param proxy     A pointer to GDBusProxy object.
+ * @param user_data A pointer to the context.
+ */
+static void proxy_removed_cb(GDBusProxy *proxy, void *user_data)
+{
+	if (is_device_proxy(proxy))
+		device_disconnected(user_data, g_dbus_proxy_get_path(proxy));
+}
+
+/**
+ * @brief This function is used as a callback for property changes, a device
+ * whose Connected property turns false loses its subscriptions.
+ *
+ * @param proxy     A pointer to GDBusProxy object.
+ * @param name      The name of the property.
+ * @param iter      A pointer to DBusMessageIter holding the new value.
+ * @param user_data A pointer to the context.
+ */
+static void property_changed_cb(GDBusProxy *proxy, const char *name,
+					DBusMessageIter *iter, void *user_data)
+{
+	dbus_bool_t connected;
+
+	if (!is_device_proxy(proxy) || strcmp(name, "Connected"))
 		return;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_BOOLEAN)
+		return;
+
+	dbus_message_iter_get_basic(iter, &connected);
+	if (!connected)
+		device_disconnected(user_data, g_dbus_proxy_get_path(proxy));
+}
+
+/**
+ * @brief This function is used as a callback when bluetoothd disconnects from
+ * the bus, all notifications are stopped since nobody is listening anymore.
+ *
+ * @param conn      A pointer to DBusConnection.
+ * @param user_data A pointer to the context.
+ */
+static void disconnect_cb(DBusConnection *conn, void *user_data)
+{
+	hrp_info("bluetoothd disconnected");
+
+	stop_notifications(user_data);
+}
+
+/**
+ * @brief This function is used to create the context, open the state file
+ * and export the ObjectManager. No service is registered yet and nothing is
+ * asked of bluetoothd.
+ *
+ * @param connection    A pointer to DBusConnection.
+ * @param config        A pointer to the configuration.
+ *
+ * @return A pointer to the context or NULL on error.
+ */
+static struct hrp *hrp_new(DBusConnection *connection,
+					const struct hrp_config *config)
+{
+	struct hrp *hrp;
+
+	hrp = g_new0(struct hrp, 1);
+	hrp->conn = dbus_connection_ref(connection);
+	hrp->adapter = g_strdup(config->adapter);
+	hrp->started = stats_now();
+
+	hrp->notify_interval = config->notify_interval ?
+					config->notify_interval : 1000;
+	hrp->adaptive_enabled = config->adaptive;
+	hrp->adaptive_delta = config->adaptive_delta;
+	hrp->adaptive_keepalive = config->adaptive_keepalive;
+	hrp->notify_queue_len = config->queue_len ?
+			MIN(config->queue_len, NOTIFY_QUEUE_MAX_LEN) : 8;
+	hrp->notify_queue_policy = config->queue_policy;
+	hrp->notify_queue_high_water = config->queue_high_water;
+	hrp->coalesce_enabled = config->coalesce;
+	hrp->coalesce_window = config->coalesce_window;
+
+	if (config->state) {
+		int err = state_open(config->state, &hrp->state);
+
+		if (err < 0)
+			hrp_warn("Couldn't open state file %s: %s",
+						config->state, strerror(-err));
+	}
+
+	/* Fails for a second server on the connection, "/" is taken */
+	hrp->om = object_manager_attach(connection);
+	if (!hrp->om) {
+		hrp_error("Couldn't export the ObjectManager");
+		hrp_detach(hrp);
+		return NULL;
 	}
+
+	return hrp;
+}
+
+/**
+ * @brief This function is used to attach the server to a connection owned
+ * by the host, see hrp.h.
+ *
+ * @param connection    A pointer to DBusConnection.
+ * @param config        A pointer to the configuration.
+ *
+ * @return A pointer to the context or NULL on error.
+ */
+struct hrp *hrp_attach(DBusConnection *connection,
+					const struct hrp_config *config)
+{
+	struct hrp *hrp;
+
+	hrp = hrp_new(connection, config);
+	if (!hrp)
+		return NULL;
+
+	/*
+	 * Ask bluetoothd for its objects first, the reply comes back while the
+	 * services are built. Proxies are only handled from the main loop, so
+	 * RegisterApplication still sees the complete tree.
+	 */
+	hrp->client = g_dbus_client_new(connection, "org.bluez", "/");
+
+	g_dbus_client_set_proxy_handlers(hrp->client, proxy_added_cb,
+					proxy_removed_cb, property_changed_cb,
+					hrp);
+
+	g_dbus_client_set_disconnect_watch(hrp->client, disconnect_cb, hrp);
+	g_dbus_client_set_ready_watch(hrp->client, client_ready_cb, hrp);
+
+	if (create_services(hrp, config->instances, &config->service) !=
+							config->instances)
+		hrp_warn("Only some of the %u services could be registered",
+							config->instances);
+
+	/* Before RegisterApplication, centrals must not see a blank state */
+	restore_state(hrp);
+
+	/* bluetoothd's GetManagedObjects then only copies the reply */
+	object_manager_build(hrp->om);
+
+	return hrp;
 }
 
+/**
+ * @brief This function is used to detach the server, unregistering the
+ * services and closing the state file.
+ *
+ * @param hrp   A pointer to the context, may be NULL.
+ */
+void hrp_detach(struct hrp *hrp)
+{
+	if (!hrp)
+		return;
+
+	if (hrp->client)
+		g_dbus_client_unref(hrp->client);
 
+	/*
+	 * Devices point at the characteristics about to be freed. The state
+	 * file keeps their subscriptions for the next attach.
+	 */
+	reset_notifications(hrp, false);
+	remove_services(hrp);
+	object_manager_detach(hrp->om);
+	state_close(hrp->state);
 
+	g_slist_free_full(hrp->sinks, g_free);
+
+	dbus_connection_unref(hrp->conn);
+	g_free(hrp->adapter);
+	g_free(hrp);
+}
@@ -11,22 +11,69 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <glib.h>
 #include <dbus/dbus.h>
 
 #include "gdbus/gdbus.h"
 
+/*
+ * Log levels. Messages above HRP_LOG_MAX_LEVEL are compiled out, e.g. build
+ * with -DHRP_LOG_MAX_LEVEL=HRP_LOG_WARN to drop all info and debug output.
+ * The rest is filtered at runtime against hrp_log_level.
+ */
+#define HRP_LOG_ERROR           0
+#define HRP_LOG_WARN            1
+#define HRP_LOG_INFO            2
+#define HRP_LOG_DEBUG           3
+
+#ifndef HRP_LOG_MAX_LEVEL
+#define HRP_LOG_MAX_LEVEL       HRP_LOG_DEBUG
+#endif
+
+extern int hrp_log_level;
+
+#define hrp_log_enabled(level) \
+	((level) <= HRP_LOG_MAX_LEVEL && (level) <= hrp_log_level)
+
+#define hrp_log(level, fmt, ...) do {					\
+	if (hrp_log_enabled(level))					\
+		hrp_log_print(level, fmt, ##__VA_ARGS__);		\
+} while (0)
+
+#define hrp_error(fmt, ...)	hrp_log(HRP_LOG_ERROR, fmt, ##__VA_ARGS__)
+#define hrp_warn(fmt, ...)	hrp_log(HRP_LOG_WARN, fmt, ##__VA_ARGS__)
+#define hrp_info(fmt, ...)	hrp_log(HRP_LOG_INFO, fmt, ##__VA_ARGS__)
+#define hrp_debug(fmt, ...)	hrp_log(HRP_LOG_DEBUG, fmt, ##__VA_ARGS__)
+
 #define GATT_MGR_IFACE          "org.bluez.GattManager1" 
 #define GATT_SERVICE_IFACE      "org.bluez.GattService1"                        
 #define GATT_CHR_IFACE          "org.bluez.GattCharacteristic1"                 
 #define GATT_DESCRIPTOR_IFACE   "org.bluez.GattDescriptor1"                     
+#define DEVICE_IFACE            "org.bluez.Device1"
+#define HRP_STATS_IFACE         "org.hrp.Stats1"
+#define OBJECT_MANAGER_IFACE    "org.freedesktop.DBus.ObjectManager"
+
+/* Default ATT MTU and header size of an ATT Handle Value Notification */
+#define ATT_DEFAULT_LE_MTU      23
+#define ATT_NOTIFY_HDR_LEN      3
+#define ATT_MAX_VALUE_LEN       512
                                                                                  
 /* Heart Rate Service UUID */                                                   
 #define HRP_UUID            "0000180d-0000-1000-8000-00805f9b34fb"              
@@ -36,32 +83,239 @@
 #define BODY_SENSOR_LOC_CHR_UUID        "00002a38-0000-1000-8000-00805f9b34fb"  
 #define HR_CTRL_PT_CHR_UUID     "00002a39-0000-1000-8000-00805f9b34fb"          
                                                                               
+/* Battery Service and Device Information Service UUIDs */
+#define BATTERY_UUID            "0000180f-0000-1000-8000-00805f9b34fb"
+#define BATTERY_LEVEL_CHR_UUID  "00002a19-0000-1000-8000-00805f9b34fb"
+#define DEVICE_INFO_UUID        "0000180a-0000-1000-8000-00805f9b34fb"
+#define MANUFACTURER_NAME_CHR_UUID      "00002a29-0000-1000-8000-00805f9b34fb"
+#define MODEL_NUMBER_CHR_UUID   "00002a24-0000-1000-8000-00805f9b34fb"
+
 /* Descriptor UUID */                                                           
 #define CLIENT_CHR_CONFIG_DESCRIPTOR_UUID   "82602902-1a54-426b-9e36-e84c238bc669"
                                                                              
-/*                                                                              
- * Heart Rate measurement support notification only. Supported                  
- * properties are defined at doc/gatt-api.txt. See "Flags"                      
- * property of the GattCharacteristic1.                                         
- */                                                                             
-static const char *hrs_hr_msrmt_props[] = { "notify", NULL };                   
-static const char *hrs_body_sensor_loc_props[] = { "read", NULL };              
-static const char *hrs_hr_ctrl_pt_props[] = { "write", NULL };                 
-static const char *ccc_desc_props[] = { "read", "write", NULL };   
+/* Heart Rate Measurement flags, see Heart Rate Service 3.1.1.1 */
+#define HRM_FLAG_HR_UINT16              0x01
+#define HRM_FLAG_CONTACT_DETECTED       0x02
+#define HRM_FLAG_CONTACT_SUPPORTED      0x04
+#define HRM_FLAG_ENERGY_EXPENDED        0x08
+#define HRM_FLAG_RR_INTERVAL            0x10
+
+/* Number of RR-intervals kept while waiting for the next notification */
+#define HRM_RR_QUEUE_LEN        32
+
+/**
+ * @struct hrm_state
+ * Represents the sensor state encoded into a Heart Rate Measurement
+ */
+struct hrm_state {
+	uint16_t hr;
+	bool contact_supported;
+	bool contact;
+	bool energy_present;
+	uint16_t energy;
+	uint16_t rr[HRM_RR_QUEUE_LEN];
+	unsigned int rr_head;
+	unsigned int rr_count;
+};
+
+/**
+ * @struct hrs_config
+ * Represents the configuration of a Heart Rate Service instance
+ */
+struct hrs_config {
+	uint8_t location;
+	bool contact_supported;
+	bool ctrl_pt_write_without_response;
+	bool battery;
+	bool device_info;
+};
+
+/* Upper bound for the notification queue length */
+#define NOTIFY_QUEUE_MAX_LEN    1024
+
+/**
+ * @enum notify_policy
+ * Represents what gives way when the notification queue is full, the
+ * default comes first
+ */
+enum notify_policy {
+	NOTIFY_COALESCE_LATEST,
+	NOTIFY_DROP_OLDEST,
+	NOTIFY_DROP_NEWEST,
+};
+
+/**
+ * @struct hrp_config
+ * Represents the configuration of a server attached with hrp_attach(),
+ * zeroed fields select the defaults
+ */
+struct hrp_config {
+	unsigned int instances;
+	struct hrs_config service;
+	const char *adapter;
+	const char *state;
+	/* period of the notification timer in milliseconds, 0 for 1000 */
+	unsigned int notify_interval;
+	/*
+	 * emit at most one PropertiesChanged per window for attributes where
+	 * only the latest value matters (Body Sensor Location and the CCC
+	 * descriptor), a window of 0 is once per main loop iteration
+	 */
+	bool coalesce;
+	unsigned int coalesce_window;
+	/*
+	 * notify a Heart Rate Measurement right away once the heart rate, or
+	 * the one an RR-interval implies, is adaptive_delta away from the last
+	 * notified value or the contact changed; while it is steady the timer
+	 * backs off to adaptive_keepalive milliseconds, doubling each time
+	 */
+	bool adaptive;
+	unsigned int adaptive_delta;
+	unsigned int adaptive_keepalive;
+	/*
+	 * queue notifications wait in while the acquired notify socket is
+	 * busy: its length, 0 for 8, and the length at which an instance is
+	 * reported as congested, 0 for a full queue
+	 */
+	unsigned int queue_len;
+	enum notify_policy queue_policy;
+	unsigned int queue_high_water;
+};
+
+/* GATT services and characteristics one instance registers at most */
+#define HRS_MAX_SERVICES        3
+#define HRS_MAX_CHRS            8
+
+/* Latency histogram buckets: <1us, then powers of two up to >=16ms */
+#define HRP_STATS_BUCKETS       16
+
+/**
+ * @struct chr_stats
+ * Represents the counters and histograms kept for one characteristic
+ */
+struct chr_stats {
+	atomic_uint_fast64_t writes;
+	atomic_uint_fast64_t reads;
+	atomic_uint_fast64_t notifications;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t drops;
+	atomic_uint_fast64_t handler_ns;
+	atomic_uint_fast64_t latency[HRP_STATS_BUCKETS];
+	atomic_uint_fast64_t handler[HRP_STATS_BUCKETS];
+	uint64_t since;
+	uint64_t pending_since;
+};
 
-static GSList *services;
+/* Layout of the state file, bump the version whenever it changes */
+#define HRP_STATE_MAGIC         0x53505248	/* "HRPS" */
+#define HRP_STATE_VERSION       1
+#define HRP_STATE_INSTANCES     16
+#define HRP_STATE_DEVICES       32
+#define HRP_STATE_PATH_LEN      64
+
+#define HRP_STATE_LOCATION      0x01
+#define HRP_STATE_ENERGY        0x02
+
+/**
+ * @struct hrp_state_instance
+ * Represents the sensor state of one instance kept in the state file
+ */
+struct hrp_state_instance {
+	uint8_t valid;
+	uint8_t location;
+	uint16_t energy;
+};
+
+/**
+ * @struct hrp_state_device
+ * Represents the CCC subscriptions of one device kept in the state file,
+ * one bitmask of characteristic indices per instance
+ */
+struct hrp_state_device {
+	char path[HRP_STATE_PATH_LEN];
+	uint16_t mtu;
+	uint8_t ccc[HRP_STATE_INSTANCES];
+};
+
+/**
+ * @struct hrp_state
+ * Represents the state file
+ */
+struct hrp_state {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	struct hrp_state_instance instances[HRP_STATE_INSTANCES];
+	struct hrp_state_device devices[HRP_STATE_DEVICES];
+};
+
+struct characteristic;
+struct arena;
+struct notify_queue;
+
+/* opaque server context, see hrp_attach() */
+struct hrp;
+
+/**
+ * @struct hr_service
+ * Represents one Heart Rate Service instance and its sensor state
+ */
+struct hr_service {
+	struct hrp *hrp;
+	struct arena *arena;
+	char *path;
+	char *paths[HRS_MAX_SERVICES];
+	unsigned int n_paths;
+	struct characteristic *chrs[HRS_MAX_CHRS];
+	unsigned int n_chrs;
+	unsigned int index;
+	unsigned int next_id;
+	struct hrm_state hrm;
+	uint32_t energy;
+	bool pending;
+	uint16_t sent_hr;
+	bool sent_contact;
+	bool significant;
+	unsigned int n_congested;
+	atomic_bool congested;
+	struct characteristic *msrmt;
+	struct characteristic *location;
+	struct characteristic *ctrl_pt;
+};
 
 /**
  * @struct characteristic 
  * Represents the characteristic of HRP
  */
 struct characteristic {
-	char *service;
-	char *uuid;
+	struct hr_service *hrs;
+	struct descriptor *desc;
+	const char *service;
+	const char *uuid;
 	char *path;
-	uint8_t *value;
+	uint8_t value[ATT_MAX_VALUE_LEN];
 	int vlen;
 	const char **props;
+	unsigned int flags;
+	GIOChannel *notify_io;
+	guint notify_watch;
+	struct notify_queue *notify_queue;
+	guint notify_out_watch;
+	bool congested;
+	GIOChannel *write_io;
+	guint write_watch;
+	bool notifying;
+	guint notify_timer;
+	unsigned int notify_period;
+	bool coalesce;
+	guint coalesce_source;
+	DBusMessage *read_cache;
+	uint16_t mtu;
+	unsigned int subscribers;
+	uint16_t sub_mtu;
+	bool ccc_started;
+	unsigned int index;
+	struct chr_stats stats;
 };
 
 /**
@@ -70,39 +324,749 @@ struct characteristic {
  */
 struct descriptor {
 	struct characteristic *chr;
-	char *uuid;
+	const char *uuid;
 	char *path;
-	uint8_t *value;
+	uint8_t value[ATT_MAX_VALUE_LEN];
 	int vlen;
 	const char **props;
+	bool coalesce;
+	guint coalesce_source;
+	DBusMessage *read_cache;
 };
 
 /**
- * @brief create the service for HRP
+ * @brief attach the server to a connection owned by the host
+ *
+ * Exports the ObjectManager and the services, restores the state file and
+ * registers the application once bluetoothd's GattManager1 shows up. All
+ * state lives in the returned context. Callbacks are dispatched from the
+ * default GMainContext, which gdbus hooks the connection into and the host
+ * keeps running; no main loop is created. The ObjectManager takes "/", so
+ * there is one server per connection, and two servers must not share a
+ * state file.
+ *
+ * Every instance gets its own object paths (/service1, /service2, ...) and
+ * sensor state, all exposed by the single RegisterApplication on "/".
+ *
+ * The connection must come from g_dbus_setup_bus() or
+ * g_dbus_setup_private(), which hook it into the main loop; a plain
+ * dbus_bus_get() connection never dispatches anything.
+ *
+ * @param connection A pointer to DBusConnection on the system bus
+ * @param config     The configuration, adapter NULL for every adapter and
+ *                   state NULL for no state file
+ *
+ * @return A pointer to the context or NULL on error
+ */
+struct hrp *hrp_attach(DBusConnection *connection,
+					const struct hrp_config *config);
+
+/**
+ * @brief detach the server and release what hrp_attach() set up
  *
- * This function will create's the service by registering the service and their
- * characteristic
+ * @param hrp A pointer to the context, may be NULL
+ */
+void hrp_detach(struct hrp *hrp);
+
+/**
+ * @brief function called when an instance becomes congested or recovers
  *
- * @param connection A pointer to DBusConnection representing the DBus connection
+ * @param index     The service instance number
+ * @param congested Whether notifications are backing up
+ * @param user_data The pointer given to set_congestion_cb()
  */
-void create_services_one(DBusConnection *connection);
+typedef void (*congestion_func_t)(unsigned int index, bool congested,
+							void *user_data);
 
 /**
- * @brief registers HRP application
- * @param proxy A pointer to GDBusproxy representing HRP application
+ * @brief set the function told about congestion changes
+ *
+ * Called from the main loop once an instance reaches the high-water mark
+ * and again once all of its queues drained. Only the acquired notify
+ * socket reports back-pressure, so only that path queues.
+ *
+ * @param hrp       A pointer to the context
+ * @param func      The function, NULL to remove it
+ * @param user_data A pointer passed to func
  */
-void register_app(GDBusProxy *proxy);
+void set_congestion_cb(struct hrp *hrp, congestion_func_t func,
+							void *user_data);
 
 /**
- * @brief callback function for handling data
- * 
- * This function prints the data and the size of the data which is write to the
- * characteristic and the descriptor
+ * @brief tell whether an instance is congested
+ *
+ * Safe to call from a producer thread once the services are created.
+ *
+ * @param hrp   A pointer to the context
+ * @param index The service instance number
+ *
+ * @return true while the instance is above its high-water mark
+ */
+bool notify_congested(struct hrp *hrp, unsigned int index);
+
+/**
+ * @brief stop all notifications
+ *
+ * Cancels the notification timers and releases acquired notification
+ * sockets, used when bluetoothd goes away.
+ *
+ * @param hrp   A pointer to the context
+ */
+void stop_notifications(struct hrp *hrp);
+
+/**
+ * @brief forget a device that disconnected
+ *
+ * Its CCC subscriptions are dropped, notifications stop once nobody is
+ * subscribed anymore and the notification MTU is recomputed.
+ *
+ * @param hrp   A pointer to the context
+ * @param path  The object path of the device
+ */
+void device_disconnected(struct hrp *hrp, const char *path);
+
+/**
+ * @brief print the statistics of every characteristic
+ *
+ * @param hrp   A pointer to the context
+ */
+void dump_stats(struct hrp *hrp);
+
+/**
+ * @brief copy a cached method return as the reply to a method call
+ *
+ * @param cache A pointer to the cached method return
+ * @param msg   A pointer to the method call being answered
+ *
+ * @return The reply or NULL if out of memory
+ */
+DBusMessage *reply_from_cache(DBusMessage *cache, DBusMessage *msg);
+
+struct object_manager;
+
+/**
+ * @brief export the ObjectManager on "/", replaces
+ * g_dbus_attach_object_manager()
+ *
+ * @param conn  A pointer to the DBusConnection
+ *
+ * @return A pointer to the ObjectManager or NULL on error, e.g. when "/"
+ * of the connection has one already
+ */
+struct object_manager *object_manager_attach(DBusConnection *conn);
+
+/**
+ * @brief remove the ObjectManager from "/" and free it
+ *
+ * @param om    A pointer to the ObjectManager, may be NULL
+ */
+void object_manager_detach(struct object_manager *om);
+
+/**
+ * @brief build the cached GetManagedObjects reply unless it is up to date
+ *
+ * Called once the tree is complete, so the first GetManagedObjects is
+ * answered from the cache as well.
+ *
+ * @param om    A pointer to the ObjectManager
+ *
+ * @return A pointer to the cached reply or NULL if out of memory
+ */
+DBusMessage *object_manager_build(struct object_manager *om);
+
+/**
+ * @brief drop the cached GetManagedObjects reply
+ *
+ * @param om    A pointer to the ObjectManager
+ */
+void object_manager_invalidate(struct object_manager *om);
+
+/**
+ * @brief register an interface for the ObjectManager to report
+ *
+ * Same as g_dbus_register_interface() on the connection of the
+ * ObjectManager, plus an entry in the registry GetManagedObjects is
+ * answered from.
+ *
+ * @return TRUE on success
+ */
+gboolean object_register(struct object_manager *om, const char *path,
+				const char *name,
+				const GDBusMethodTable *methods,
+				const GDBusSignalTable *signals,
+				const GDBusPropertyTable *props,
+				void *data, GDBusDestroyFunction destroy);
+
+/**
+ * @brief unregister an interface registered with object_register()
+ *
+ * @param om    A pointer to the ObjectManager
+ * @param path  The object path
+ * @param name  The interface name
+ *
+ * @return TRUE on success
+ */
+gboolean object_unregister(struct object_manager *om, const char *path,
+							const char *name);
+
+/**
+ * @brief emit PropertiesChanged for an object registered with
+ * object_register()
+ *
+ * Same as g_dbus_emit_property_changed(), the cached reply is dropped.
+ */
+void object_property_changed(struct object_manager *om, const char *path,
+					const char *iface, const char *name);
+
+/**
+ * @brief map the state file, creating it if needed
+ *
+ * @param path  The path of the state file
+ * @param state Updated with a pointer to the mapped state
+ *
+ * @return 0 on success or a negative error code
+ */
+int state_open(const char *path, struct hrp_state **state);
+
+/**
+ * @brief unmap the state file
+ *
+ * @param state A pointer to the mapped state, may be NULL
+ */
+void state_close(struct hrp_state *state);
+
+/**
+ * @brief schedule write-back of the state after a change
+ *
+ * @param state A pointer to the mapped state, may be NULL
+ */
+void state_sync(struct hrp_state *state);
+
+/* RR-intervals carried by one sample, enough for 240 bpm at 1 Hz */
+#define HR_SAMPLE_MAX_RR        4
+
+/**
+ * @struct hr_sample
+ * Represents one sample pushed by the sensor acquisition thread
+ */
+struct hr_sample {
+	uint16_t sensor;
+	uint16_t hr;
+	uint8_t contact;
+	uint8_t rr_count;
+	uint16_t rr[HR_SAMPLE_MAX_RR];
+	/* Energy expended since the previous sample, in Joules */
+	uint16_t energy;
+};
+
+struct sample_ring;
+
+/**
+ * @brief function called from the main loop when samples are available
+ *
+ * It must peek and consume until sample_ring_peek() returns 0, only a push
+ * into a drained ring wakes the main loop up again.
+ *
+ * @param ring      The ring with pending samples
+ * @param user_data The pointer given to sample_ring_attach()
+ */
+typedef void (*sample_ring_func_t)(struct sample_ring *ring, void *user_data);
+
+/**
+ * @brief create a single-producer/single-consumer sample ring
+ *
+ * @param size  Number of samples, rounded up to a power of two
+ *
+ * @return A pointer to the ring or NULL on error
+ */
+struct sample_ring *sample_ring_new(unsigned int size);
+
+/**
+ * @brief free a sample ring, detaching it from the main loop
+ *
+ * @param ring  A pointer to the ring
+ */
+void sample_ring_free(struct sample_ring *ring);
+
+/**
+ * @brief push a sample, to be called from the producer thread only
+ *
+ * Never blocks, the main loop is woken up through an eventfd when the
+ * ring was drained; samples pushed while it is busy need no wakeup.
+ *
+ * @param ring      A pointer to the ring
+ * @param sample    A pointer to the sample, copied into the ring
+ *
+ * @return false if the ring is full and the sample was dropped
+ */
+bool sample_ring_push(struct sample_ring *ring, const struct hr_sample *sample);
+
+/**
+ * @brief get the contiguous run of pending samples, consumer only
+ *
+ * @param ring      A pointer to the ring
+ * @param samples   Updated with a pointer to the first pending sample
+ *
+ * @return Number of samples available at samples, 0 if the ring is empty
+ */
+unsigned int sample_ring_peek(struct sample_ring *ring,
+					const struct hr_sample **samples);
+
+/**
+ * @brief release samples returned by sample_ring_peek(), consumer only
+ *
+ * @param ring  A pointer to the ring
+ * @param count Number of samples consumed
+ */
+void sample_ring_consume(struct sample_ring *ring, unsigned int count);
+
+/**
+ * @brief hook the ring's eventfd into the default main context
+ *
+ * @param ring      A pointer to the ring
+ * @param func      The function called when samples are available
+ * @param user_data A pointer passed to func
+ *
+ * @return The source id, 0 on error
+ */
+guint sample_ring_attach(struct sample_ring *ring, sample_ring_func_t func,
+							void *user_data);
+
+/**
+ * @brief feed the heart rate service from a sample ring
+ *
+ * Every wakeup drains all pending samples into the sensor state and then
+ * sends one notification on each notifying measurement characteristic.
+ *
+ * @param hrp   A pointer to the context
+ * @param ring  A pointer to the ring
+ *
+ * @return The source id, 0 on error
+ */
+guint attach_sample_ring(struct hrp *hrp, struct sample_ring *ring);
+
+struct sensor;
+
+/**
+ * @brief function run on the sensor thread
+ *
+ * Initialises the sensor, calls sensor_ready() and then pushes samples until
+ * sensor_wait() returns false.
+ *
+ * @param sensor    The sensor
+ * @param user_data The pointer given to sensor_start()
+ *
+ * @return 0 or a negative error code if the sensor failed
+ */
+typedef int (*sensor_func_t)(struct sensor *sensor, void *user_data);
+
+/**
+ * @brief start a sensor thread feeding the heart rate service
+ *
+ * Returns right away, the services keep their placeholder values until the
+ * first samples arrive.
+ *
+ * @param hrp       A pointer to the context fed by the sensor
+ * @param func      The function run on the sensor thread
+ * @param size      Number of samples the ring holds
+ * @param user_data A pointer passed to func
+ *
+ * @return A pointer to the sensor or NULL on error
+ */
+struct sensor *sensor_start(struct hrp *hrp, sensor_func_t func,
+					unsigned int size, void *user_data);
+
+/**
+ * @brief stop a sensor thread and wait for it
+ *
+ * @param sensor    A pointer to the sensor, may be NULL
+ */
+void sensor_stop(struct sensor *sensor);
+
+/**
+ * @brief tell the main loop the sensor delivers, sensor thread only
+ *
+ * @param sensor    A pointer to the sensor
+ */
+void sensor_ready(struct sensor *sensor);
+
+/**
+ * @brief push a sample, sensor thread only
+ *
+ * @param sensor    A pointer to the sensor
+ * @param sample    A pointer to the sample, copied into the ring
+ *
+ * @return false if the ring is full and the sample was dropped
+ */
+bool sensor_push(struct sensor *sensor, const struct hr_sample *sample);
+
+/**
+ * @brief tell whether the sensor is being stopped
+ *
+ * @param sensor    A pointer to the sensor
+ *
+ * @return true once sensor_stop() was called
+ */
+bool sensor_stopping(struct sensor *sensor);
+
+/**
+ * @brief sleep on the sensor thread, waking up early on sensor_stop()
+ *
+ * @param sensor    A pointer to the sensor
+ * @param msec      How long to sleep in milliseconds
+ *
+ * @return false if the sensor thread should return
+ */
+bool sensor_wait(struct sensor *sensor, unsigned int msec);
+
+struct trace;
+
+/**
+ * @brief map a recorded trace for replay, see trace.c for the format
+ *
+ * @param path      The path of the trace
+ * @param speed     Replay rate relative to the recording, 0 for as fast as
+ *                  the samples are consumed
+ * @param sensors   Number of instances fed from the trace
+ *
+ * @return A pointer to the trace or NULL on error
+ */
+struct trace *trace_open(const char *path, double speed, unsigned int sensors);
+
+/**
+ * @brief unmap a trace, stop the sensor replaying it first
+ *
+ * @param trace A pointer to the trace, may be NULL
+ */
+void trace_close(struct trace *trace);
+
+/**
+ * @brief sensor function replaying a trace in a loop
+ *
+ * @param sensor    The sensor
+ * @param user_data A pointer to the trace
+ *
+ * @return 0 once the sensor is stopped
+ */
+int trace_replay(struct sensor *sensor, void *user_data);
+
+/**
+ * @brief queue an RR-interval for the next Heart Rate Measurement
+ *
+ * When the queue is full the oldest interval is dropped.
+ *
+ * @param state A pointer to the sensor state
+ * @param rr    The RR-interval in units of 1/1024 second
+ */
+void hrm_queue_rr(struct hrm_state *state, uint16_t rr);
+
+/**
+ * @brief encode a Heart Rate Measurement (0x2A37) value
+ *
+ * Writes flags, the heart rate (as uint8 when it fits, uint16 otherwise),
+ * the sensor contact bits, Energy Expended when present and as many queued
+ * RR-intervals as fit into size. Encoded intervals are removed from the
+ * queue, the rest is left for the next notification. No memory is allocated.
+ *
+ * @param state A pointer to the sensor state
+ * @param buf   The buffer to encode into
+ * @param size  Size of buf, usually the MTU minus the notification header
+ *
+ * @return The encoded length or -ENOSPC if not even the heart rate fits
+ */
+int hrm_encode(struct hrm_state *state, uint8_t *buf, size_t size);
+
+/**
+ * @brief update the heart rate reported by the next notification
+ *
+ * @param hrp       A pointer to the context
+ * @param index     The service instance number
+ * @param hr        The heart rate in beats per minute
+ * @param contact   Whether the sensor detects skin contact
+ *
+ * @return 0 on success, -ENOENT if there is no such instance
+ */
+int update_heart_rate(struct hrp *hrp, unsigned int index, uint16_t hr,
+								bool contact);
+
+/**
+ * @brief queue an RR-interval for the next notification
+ *
+ * @param hrp   A pointer to the context
+ * @param index The service instance number
+ * @param rr    The RR-interval in units of 1/1024 second
+ *
+ * @return 0 on success, -ENOENT if there is no such instance
+ */
+int queue_rr_interval(struct hrp *hrp, unsigned int index, uint16_t rr);
+
+/**
+ * @brief update the Energy Expended reported by the next notification
+ *
+ * The value is kept in the state file as well.
+ *
+ * @param hrp       A pointer to the context
+ * @param index     The service instance number
+ * @param energy    The accumulated energy in kilo Joules
+ *
+ * @return 0 on success, -ENOENT if there is no such instance
+ */
+int update_energy_expended(struct hrp *hrp, unsigned int index,
+							uint16_t energy);
+
+/**
+ * @brief add to the Energy Expended accumulator
+ *
+ * Reset to zero by the Reset Energy Expended control point command.
+ *
+ * @param hrp       A pointer to the context
+ * @param index     The service instance number
+ * @param joules    The energy expended since the last call in Joules
+ *
+ * @return 0 on success, -ENOENT if there is no such instance
+ */
+int add_energy_expended(struct hrp *hrp, unsigned int index, uint16_t joules);
+
+/**
+ * @brief data sink for values written to a characteristic or descriptor
+ *
+ * The value is borrowed, usually straight from the WriteValue message. A
+ * sink that needs it after returning calls sink_ref_message() or copies it.
+ *
+ * @param uuid      The UUID of the attribute
+ * @param value     The new value, only valid for the duration of the call
+ * @param len       Length of the value
+ * @param user_data The pointer given to register_sink()
+ */
+typedef void (*sink_func_t)(const char *uuid, const uint8_t *value, int len,
+							void *user_data);
+
+/**
+ * @brief register a data sink
+ *
+ * The sink is called for every value written to any characteristic or
+ * descriptor with the given UUID. A later registration for the same UUID
+ * replaces the earlier one. Without any sink the dispatch is skipped.
+ *
+ * @param hrp       A pointer to the context
+ * @param uuid      The characteristic or descriptor UUID
+ * @param func      The function to be called
+ * @param user_data A pointer passed to func
+ *
+ * @return 0 on success, -EINVAL on invalid arguments
+ */
+int register_sink(struct hrp *hrp, const char *uuid, sink_func_t func,
+							void *user_data);
+
+/**
+ * @brief remove the data sink registered for a UUID
+ *
+ * @param hrp   A pointer to the context
+ * @param uuid  The characteristic or descriptor UUID
+ */
+void unregister_sink(struct hrp *hrp, const char *uuid);
+
+/**
+ * @brief keep the value handed to the running sink alive
+ *
+ * Only valid from within a sink. The value stays valid until the returned
+ * message is unreferenced with dbus_message_unref().
+ *
+ * @param hrp   A pointer to the context the sink is registered with
+ *
+ * @return A new reference to the message the value points into, NULL if
+ * it does not come from a message and has to be copied
+ */
+DBusMessage *sink_ref_message(struct hrp *hrp);
+
+/**
+ * @brief print a log message
+ *
+ * Use the hrp_error/hrp_warn/hrp_info/hrp_debug macros instead, they skip
+ * the formatting when the level is disabled. A newline is appended.
+ *
+ * @param level     The log level of the message
+ * @param format    printf style format string
+ */
+void hrp_log_print(int level, const char *format, ...)
+				__attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief set the runtime log level
+ *
+ * @param name  One of "error", "warn", "info" or "debug"
+ *
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int set_log_level(const char *name);
+
+/**
+ * @brief create an arena
+ *
+ * @param chunk_size    Size of the blocks taken from the heap, 0 for 4 KiB
+ *
+ * @return A pointer to the arena
+ */
+struct arena *arena_new(size_t chunk_size);
+
+/**
+ * @brief allocate zeroed memory from an arena
+ *
+ * @param arena A pointer to the arena
+ * @param size  Number of bytes
+ *
+ * @return A pointer to the memory, valid until arena_free()
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * @brief copy a string into an arena
+ *
+ * @param arena A pointer to the arena
+ * @param str   The string, may be NULL
+ *
+ * @return A pointer to the copy
+ */
+char *arena_strdup(struct arena *arena, const char *str);
+
+/**
+ * @brief format a string into an arena
+ *
+ * @param arena     A pointer to the arena
+ * @param format    printf style format string
+ *
+ * @return A pointer to the formatted string
+ */
+char *arena_printf(struct arena *arena, const char *format, ...)
+				__attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief free an arena and everything allocated from it
+ *
+ * @param arena A pointer to the arena
+ */
+void arena_free(struct arena *arena);
+
+/**
+ * @brief create a notification queue
+ *
+ * @param size      Maximum number of notifications, always 1 for
+ *                  NOTIFY_COALESCE_LATEST
+ * @param policy    What gives way once the queue is full
+ *
+ * @return A pointer to the queue or NULL on error
+ */
+struct notify_queue *notify_queue_new(unsigned int size,
+						enum notify_policy policy);
+
+/**
+ * @brief free a notification queue
+ *
+ * @param queue A pointer to the queue, may be NULL
+ */
+void notify_queue_free(struct notify_queue *queue);
+
+/**
+ * @brief queue a notification, applying the policy when full
+ *
+ * @param queue     A pointer to the queue
+ * @param value     A pointer to the value, copied into the queue
+ * @param len       Length of the value
+ * @param queued_at The time the value was written, see stats_now()
+ *
+ * @return The number of notifications dropped, 0 or 1
+ */
+unsigned int notify_queue_push(struct notify_queue *queue,
+				const uint8_t *value, int len,
+				uint64_t queued_at);
+
+/**
+ * @brief look at the oldest queued notification
+ *
+ * @param queue     A pointer to the queue
+ * @param value     Updated with a pointer to the value
+ * @param len       Updated with the length of the value
+ * @param queued_at Updated with the time it was queued, may be NULL
+ *
+ * @return false if the queue is empty
+ */
+bool notify_queue_peek(struct notify_queue *queue, const uint8_t **value,
+					int *len, uint64_t *queued_at);
+
+/**
+ * @brief remove the oldest queued notification
+ *
+ * @param queue A pointer to the queue
+ */
+void notify_queue_pop(struct notify_queue *queue);
+
+/**
+ * @brief get the number of queued notifications
+ *
+ * @param queue A pointer to the queue, may be NULL
+ *
+ * @return The number of queued notifications
+ */
+unsigned int notify_queue_length(const struct notify_queue *queue);
+
+/**
+ * @brief parse a notification queue policy name
+ *
+ * @param name      "drop-oldest", "drop-newest" or "coalesce-latest"
+ * @param policy    Updated with the policy
+ *
+ * @return 0 on success, -EINVAL if the name is unknown
+ */
+int notify_policy_from_string(const char *name, enum notify_policy *policy);
+
+/**
+ * @brief bump a statistics counter
+ *
+ * @param counter   A pointer to the counter
+ */
+static inline void stats_inc(atomic_uint_fast64_t *counter)
+{
+	atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief read the monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+uint64_t stats_now(void);
+
+/**
+ * @brief record the time elapsed since start in a histogram
+ *
+ * @param hist  The HRP_STATS_BUCKETS histogram buckets
+ * @param start The start time as returned by stats_now()
+ */
+void stats_record(atomic_uint_fast64_t *hist, uint64_t start);
+
+/**
+ * @brief account a finished ReadValue or WriteValue handler
+ *
+ * @param stats     A pointer to the statistics
+ * @param start     The time the handler was entered
+ * @param failed    Whether the handler replied with an error
+ */
+void stats_handler_done(struct chr_stats *stats, uint64_t start, bool failed);
+
+/**
+ * @brief clear all counters and restart the rate measurement
+ *
+ * @param stats A pointer to the statistics
+ */
+void stats_reset(struct chr_stats *stats);
+
+/**
+ * @brief print the statistics of one characteristic
  *
- * @param data a pointer to const char representing the data to be processed
- * @param size size of the data
+ * @param path  The object path of the characteristic
+ * @param stats A pointer to the statistics
  */
-void callback(const char *data, int size);      
+void stats_dump(const char *path, const struct chr_stats *stats);
 
 /**                                                                             
  * @brief This function allocates a block of memory of the spesified size.      
@@ -0,0 +1,58 @@
+/**
+ * @file log.c
+ * @brief Logging for the HRP GATT server.
+ *
+ * Messages are filtered by level before they are formatted, warnings and
+ * errors go to stderr, everything else to stdout.
+ */
+
+#include "hrp.h"
+
+int hrp_log_level = HRP_LOG_WARN;
+
+static const char *log_levels[] = {
+	[HRP_LOG_ERROR]	= "error",
+	[HRP_LOG_WARN]	= "warn",
+	[HRP_LOG_INFO]	= "info",
+	[HRP_LOG_DEBUG]	= "debug",
+};
+
+/**
+ * @brief This function is used to print a log message.
+ *
+ * @param level     The log level of the message.
+ * @param format    printf style format string.
+ */
+void hrp_log_print(int level, const char *format, ...)
+{
+	FILE *out = level <= HRP_LOG_WARN ? stderr : stdout;
+	va_list ap;
+
+	va_start(ap, format);
+	vfprintf(out, format, ap);
+	va_end(ap);
+
+	fputc('\n', out);
+}
+
+/**
+ * @brief This function is used to set the runtime log level.
+ *
+ * @param name  One of "error", "warn", "info" or "debug".
+ *
+ * @return 0 on success, -EINVAL if the name is unknown.
+ */
+int set_log_level(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(log_levels); i++) {
+		if (strcasecmp(name, log_levels[i]))
+			continue;
+
+		hrp_log_level = i;
+		return 0;
+	}
+
+	return -EINVAL;
+}
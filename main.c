@@ -9,6 +9,84 @@
 #include"hrp.h"
 static GMainLoop *main_loop;                                                    
 static DBusConnection *connection; 
+static struct hrp *hrp;
+
+static gint option_interval = 1000;
+static gchar *option_log_level = NULL;
+static gint option_coalesce = -1;
+static gint option_adaptive = -1;
+static gint option_keepalive = 5000;
+static gint option_instances = 1;
+static gboolean option_write_without_response = FALSE;
+static gboolean option_battery = FALSE;
+static gboolean option_device_info = FALSE;
+static gint option_queue_length = 0;
+static gchar *option_queue_policy = NULL;
+static gint option_queue_high_water = 0;
+static gchar **option_adapters = NULL;
+static gchar *option_state = NULL;
+static gint option_sensor_delay = -1;
+static gchar *option_replay = NULL;
+static gdouble option_replay_speed = 1.0;
+
+/* Adapter this process serves, NULL for all of them */
+static char *adapter_path;
+
+static GOptionEntry options[] = {
+	{ "interval", 'i', 0, G_OPTION_ARG_INT, &option_interval,
+				"Notification interval in milliseconds", "MSEC" },
+	{ "log-level", 'l', 0, G_OPTION_ARG_STRING, &option_log_level,
+				"Log level (error, warn, info, debug), "
+				"overrides HRP_LOG_LEVEL", "LEVEL" },
+	{ "instances", 'n', 0, G_OPTION_ARG_INT, &option_instances,
+				"Number of Heart Rate Service instances", "COUNT" },
+	{ "coalesce", 'c', 0, G_OPTION_ARG_INT, &option_coalesce,
+				"Coalesce PropertiesChanged of latest-value-only "
+				"attributes within a window (0 for once per loop "
+				"iteration)", "MSEC" },
+	{ "adaptive", 0, 0, G_OPTION_ARG_INT, &option_adaptive,
+				"Notify right away on a heart rate change of "
+				"DELTA bpm, back off while it is steady",
+				"DELTA" },
+	{ "keep-alive", 0, 0, G_OPTION_ARG_INT, &option_keepalive,
+				"Longest notification interval with --adaptive",
+				"MSEC" },
+	{ "write-without-response", 'w', 0, G_OPTION_ARG_NONE,
+				&option_write_without_response,
+				"Accept Write Without Response on the control "
+				"point", NULL },
+	{ "battery", 'b', 0, G_OPTION_ARG_NONE, &option_battery,
+				"Also register a Battery Service", NULL },
+	{ "device-info", 'd', 0, G_OPTION_ARG_NONE, &option_device_info,
+				"Also register a Device Information Service",
+				NULL },
+	{ "queue-length", 'q', 0, G_OPTION_ARG_INT, &option_queue_length,
+				"Notifications queued while the link is busy",
+				"COUNT" },
+	{ "queue-policy", 'p', 0, G_OPTION_ARG_STRING, &option_queue_policy,
+				"What gives way when the queue is full "
+				"(drop-oldest, drop-newest, coalesce-latest)",
+				"POLICY" },
+	{ "queue-high-water", 0, 0, G_OPTION_ARG_INT,
+				&option_queue_high_water,
+				"Queue length reported as congestion", "COUNT" },
+	{ "adapter", 'a', 0, G_OPTION_ARG_STRING_ARRAY, &option_adapters,
+				"Serve only this adapter, given more than once "
+				"runs one worker process per adapter", "hciX" },
+	{ "state", 's', 0, G_OPTION_ARG_FILENAME, &option_state,
+				"Keep subscriptions and sensor state in FILE "
+				"across restarts", "FILE" },
+	{ "simulate-sensor", 0, 0, G_OPTION_ARG_INT, &option_sensor_delay,
+				"Feed simulated samples from a sensor taking "
+				"MSEC to initialise", "MSEC" },
+	{ "replay", 0, 0, G_OPTION_ARG_FILENAME, &option_replay,
+				"Feed samples replayed from a recorded trace",
+				"FILE" },
+	{ "replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &option_replay_speed,
+				"Replay rate relative to the recording, 0 for "
+				"as fast as possible", "FACTOR" },
+	{ NULL },
+};
 
 /**                                                                             
  * @brief This function allocates a block of memory of the spesified size.      
@@ -48,25 +126,6 @@ void *util_memdup(const void *src, size_t size)
     return cpy;                                                             
 }                         
 
-/**
- * @brief This function is used as a callback for proxy-added signal when a new
- * GDBusProxy object is added.
- *
- * @param proxy     A pointer to GSBusProxy object.
- * @param user_data A pointer to the user defined data.
- */
-static void proxy_added_cb(GDBusProxy *proxy, void *user_data)
-{
-	const char *iface;
-
-	iface = g_dbus_proxy_get_interface(proxy);
-
-	if (g_strcmp0(iface, GATT_MGR_IFACE))
-		return;
-
-	register_app(proxy);
-}
-
 /**
  * @brief This function is the callback function. It is called when a signal is
  * received.
@@ -98,12 +157,15 @@ static gboolean signal_handler(GIOChannel *channel, GIOCondition cond,
 	case SIGINT:
 	case SIGTERM:
 		if (!__terminated) {
-			printf("Terminating\n");
+			hrp_info("Terminating");
 			g_main_loop_quit(main_loop);
 		}
 
 		__terminated = true;
 		break;
+	case SIGUSR1:
+		dump_stats(hrp);
+		break;
 	}
 
 	return TRUE;
@@ -122,6 +184,7 @@ static guint setup_signalfd(void)
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
 
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
 		perror("Failed to set signal mask");
@@ -149,20 +212,173 @@ static guint setup_signalfd(void)
 	return source;
 }
 
-/**                                                                             
- * @brief callback function for handling data.                                   
- *                                                                              
- * This function prints the data and the size of the data which is write to the 
- * characteristic and the descriptor.                                            
- *                                                                              
- * @param data a pointer to const char representing the data to be processed    
- * @param size size of the data.                                                 
- */        
-void callback(const char *data, int size)                                                                                                  
-{                                                                               
-    printf("%s\n", data);                                                       
-    printf("SIZE: %d\n", size);                                                 
-}                             
+/**
+ * @brief This function is used as data sink dumping every value written to the
+ * service when debug logging is enabled.
+ *
+ * @param uuid      A string representing the UUID of the attribute.
+ * @param value     A pointer to the value.
+ * @param len       Length of the value.
+ * @param user_data A pointer to user defined data.
+ */
+static void dump_sink(const char *uuid, const uint8_t *value, int len,
+							void *user_data)
+{
+	char hex[ATT_MAX_VALUE_LEN * 3 + 1];
+	int i;
+
+	for (i = 0; i < len; i++)
+		sprintf(hex + i * 3, " %02x", value[i]);
+	hex[i * 3] = '\0';
+
+	hrp_debug("%s: %d bytes:%s", uuid, len, hex);
+}
+
+/**
+ * @brief This function is used to select the adapter this process serves.
+ *
+ * @param adapter   The adapter name like "hci0" or its object path.
+ */
+static void set_adapter(const char *adapter)
+{
+	g_free(adapter_path);
+
+	if (adapter[0] == '/')
+		adapter_path = g_strdup(adapter);
+	else
+		adapter_path = g_strdup_printf("/org/bluez/%s", adapter);
+}
+
+/**
+ * @brief This function is used to run one worker process per adapter.
+ *
+ * gdbus attaches its watches to the default main context, so the adapters
+ * get a process each rather than a thread each. Every worker has its own
+ * connection, main loop and service state and returns from this function
+ * to carry on as a normal single-adapter server. The parent stays behind,
+ * forwards SIGINT, SIGTERM and SIGUSR1 to the workers and reaps them.
+ *
+ * @param adapters  NULL terminated list of adapters.
+ * @param status    Updated with the exit status in the parent.
+ *
+ * @return true in the parent once all workers exited, false in a worker.
+ */
+static bool run_workers(gchar **adapters, int *status)
+{
+	unsigned int i, n = g_strv_length(adapters), alive = 0;
+	sigset_t mask, old;
+	pid_t *workers;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGCHLD);
+
+	if (sigprocmask(SIG_BLOCK, &mask, &old) < 0) {
+		perror("Failed to set signal mask");
+		*status = EXIT_FAILURE;
+		return true;
+	}
+
+	workers = g_new0(pid_t, n);
+	*status = EXIT_SUCCESS;
+
+	for (i = 0; i < n; i++) {
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			g_free(workers);
+			sigprocmask(SIG_SETMASK, &old, NULL);
+			set_adapter(adapters[i]);
+			hrp_info("Worker %d serving %s", getpid(),
+							adapter_path);
+			return false;
+		}
+
+		if (pid < 0) {
+			perror("Failed to start worker");
+			*status = EXIT_FAILURE;
+			continue;
+		}
+
+		workers[i] = pid;
+		alive++;
+	}
+
+	while (alive) {
+		siginfo_t si;
+		int wstatus;
+		pid_t pid;
+
+		if (sigwaitinfo(&mask, &si) < 0)
+			continue;
+
+		if (si.si_signo != SIGCHLD) {
+			for (i = 0; i < n; i++)
+				if (workers[i])
+					kill(workers[i], si.si_signo);
+			continue;
+		}
+
+		while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+			for (i = 0; i < n; i++) {
+				if (workers[i] != pid)
+					continue;
+
+				workers[i] = 0;
+				alive--;
+			}
+
+			if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+				*status = EXIT_FAILURE;
+		}
+	}
+
+	g_free(workers);
+
+	return true;
+}
+
+/**
+ * @brief This function is used as the simulated sensor thread. It sleeps to
+ * stand in for a slow initialisation, then pushes one sample per instance
+ * every notification interval.
+ *
+ * @param sensor    A pointer to the sensor.
+ * @param user_data A pointer to the user defined data.
+ *
+ * @return 0 once the sensor is stopped.
+ */
+static int simulated_sensor(struct sensor *sensor, void *user_data)
+{
+	struct hr_sample sample = { .contact = 1, .rr_count = 1 };
+	unsigned int beat = 0;
+	gint i;
+
+	if (!sensor_wait(sensor, option_sensor_delay))
+		return 0;
+
+	sensor_ready(sensor);
+
+	while (sensor_wait(sensor, option_interval)) {
+		beat++;
+
+		for (i = 0; i < option_instances; i++) {
+			sample.sensor = i;
+			sample.hr = 60 + (beat + i * 7) % 40;
+			sample.rr[0] = 60 * 1024 / sample.hr;
+			/* Roughly 40 J per beat */
+			sample.energy = MIN((uint64_t) sample.hr * 40 *
+						option_interval / 60000, 0xffff);
+
+			if (!sensor_push(sensor, &sample))
+				hrp_debug("Sample ring full");
+		}
+	}
+
+	return 0;
+}
 
 /**
  * @brief main function initializes and runs the main loop of the program, which
@@ -172,8 +388,95 @@ void callback(const char *data, int size)
  */
 int main(int argc, char *argv[])
 {
-	GDBusClient *client;
+	GOptionContext *context;
+	GError *error = NULL;
+	struct hrp_config config = { 0 };
+	enum notify_policy policy = NOTIFY_COALESCE_LATEST;
+	struct sensor *sensor = NULL;
+	struct trace *trace = NULL;
 	guint signal;
+	int status;
+
+	if (getenv("HRP_LOG_LEVEL") && set_log_level(getenv("HRP_LOG_LEVEL")))
+		fprintf(stderr, "Invalid HRP_LOG_LEVEL: %s\n",
+						getenv("HRP_LOG_LEVEL"));
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		if (error) {
+			fprintf(stderr, "%s\n", error->message);
+			g_error_free(error);
+		} else
+			fprintf(stderr, "An unknown error occurred\n");
+		return EXIT_FAILURE;
+	}
+
+	g_option_context_free(context);
+
+	if (option_log_level && set_log_level(option_log_level)) {
+		fprintf(stderr, "Invalid log level: %s\n", option_log_level);
+		return EXIT_FAILURE;
+	}
+
+	g_free(option_log_level);
+
+	if (option_interval <= 0) {
+		fprintf(stderr, "Invalid notification interval: %d\n",
+							option_interval);
+		return EXIT_FAILURE;
+	}
+
+	if (option_keepalive <= 0) {
+		fprintf(stderr, "Invalid keep-alive interval: %d\n",
+							option_keepalive);
+		return EXIT_FAILURE;
+	}
+
+	if (option_instances <= 0) {
+		fprintf(stderr, "Invalid number of instances: %d\n",
+							option_instances);
+		return EXIT_FAILURE;
+	}
+
+	if (option_replay_speed < 0) {
+		fprintf(stderr, "Invalid replay speed: %g\n",
+							option_replay_speed);
+		return EXIT_FAILURE;
+	}
+
+	if (option_queue_length < 0 || option_queue_high_water < 0) {
+		fprintf(stderr, "Invalid notification queue length\n");
+		return EXIT_FAILURE;
+	}
+
+	if (option_queue_policy &&
+			notify_policy_from_string(option_queue_policy,
+								&policy)) {
+		fprintf(stderr, "Invalid queue policy: %s\n",
+							option_queue_policy);
+		return EXIT_FAILURE;
+	}
+
+	g_free(option_queue_policy);
+
+	if (option_adapters && option_adapters[0] && option_adapters[1]) {
+		if (run_workers(option_adapters, &status))
+			return status;
+
+		/* Workers must not share a state file */
+		if (option_state) {
+			char *path = g_strdup_printf("%s.%s", option_state,
+						strrchr(adapter_path, '/') + 1);
+
+			g_free(option_state);
+			option_state = path;
+		}
+	} else if (option_adapters && option_adapters[0])
+		set_adapter(option_adapters[0]);
+
+	g_strfreev(option_adapters);
 
 	signal = setup_signalfd();
 	if (signal == 0)
@@ -183,28 +486,76 @@ int main(int argc, char *argv[])
 
 	main_loop = g_main_loop_new(NULL, FALSE);
 
-	g_dbus_attach_object_manager(connection);
-
-	printf("gatt-service unique name: %s\n",
+	hrp_info("gatt-service unique name: %s",
 				dbus_bus_get_unique_name(connection));
 
-	create_services_one(connection);
+	config.instances = option_instances;
+	config.service.ctrl_pt_write_without_response =
+						option_write_without_response;
+	config.service.battery = option_battery;
+	config.service.device_info = option_device_info;
+	config.adapter = adapter_path;
+	config.state = option_state;
+	config.notify_interval = option_interval;
+	config.coalesce = option_coalesce >= 0;
+	config.coalesce_window = MAX(option_coalesce, 0);
+	config.adaptive = option_adaptive >= 0;
+	config.adaptive_delta = MAX(option_adaptive, 0);
+	config.adaptive_keepalive = option_keepalive;
+	config.queue_len = option_queue_length;
+	config.queue_policy = policy;
+	config.queue_high_water = option_queue_high_water;
+
+	hrp = hrp_attach(connection, &config);
+	g_free(option_state);
+
+	if (!hrp)
+		return EXIT_FAILURE;
+
+	/* Nothing is written before the main loop runs */
+	if (hrp_log_enabled(HRP_LOG_DEBUG)) {
+		register_sink(hrp, HR_MSRMT_CHR_UUID, dump_sink, NULL);
+		register_sink(hrp, BODY_SENSOR_LOC_CHR_UUID, dump_sink, NULL);
+		register_sink(hrp, HR_CTRL_PT_CHR_UUID, dump_sink, NULL);
+		register_sink(hrp, CLIENT_CHR_CONFIG_DESCRIPTOR_UUID,
+							dump_sink, NULL);
+	}
+
+	/* Placeholder values are served until the sensor delivers */
+	status = EXIT_SUCCESS;
+
+	if (option_replay) {
+		trace = trace_open(option_replay, option_replay_speed,
+							option_instances);
+		if (trace)
+			sensor = sensor_start(hrp, trace_replay, 4096,
+									trace);
 
-	client = g_dbus_client_new(connection, "org.bluez", "/");
+		g_free(option_replay);
 
-	g_dbus_client_set_proxy_handlers(client, proxy_added_cb, NULL, NULL,
-									NULL);
+		if (!sensor)
+			status = EXIT_FAILURE;
+	} else if (option_sensor_delay >= 0) {
+		sensor = sensor_start(hrp, simulated_sensor, 64, NULL);
+		if (!sensor)
+			status = EXIT_FAILURE;
+	}
 
-	g_main_loop_run(main_loop);
+	/* Serving placeholders without the requested source looks healthy */
+	if (status == EXIT_SUCCESS)
+		g_main_loop_run(main_loop);
 
-	g_dbus_client_unref(client);
+	sensor_stop(sensor);
+	trace_close(trace);
 
 	g_source_remove(signal);
 
-	g_slist_free_full(services, g_free);
+	hrp_detach(hrp);
 	dbus_connection_unref(connection);
 
-	return 0;
+	g_free(adapter_path);
+
+	return status;
 }
 
 
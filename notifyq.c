@@ -0,0 +1,197 @@
+/**
+ * @file notifyq.c
+ * @brief Bounded queue of notifications waiting for a congested link.
+ *
+ * The queue only fills up while the notify socket refuses writes. Its
+ * length is fixed when it is created and the policy decides what gives way
+ * once it is full, so memory stays bounded however long a central is out of
+ * range.
+ */
+
+#include "hrp.h"
+
+/**
+ * @struct notify_entry
+ * Represents one queued notification
+ */
+struct notify_entry {
+	uint64_t queued_at;
+	int len;
+	uint8_t value[ATT_MAX_VALUE_LEN];
+};
+
+/**
+ * @struct notify_queue
+ * Represents the queue, a ring of len entries
+ */
+struct notify_queue {
+	enum notify_policy policy;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	struct notify_entry entries[];
+};
+
+/**
+ * @brief This function is used to create a notification queue.
+ *
+ * @param size      Maximum number of queued notifications. Ignored for
+ *                  NOTIFY_COALESCE_LATEST, which only ever keeps one.
+ * @param policy    What to do when the queue is full.
+ *
+ * @return A pointer to the queue or NULL on error.
+ */
+struct notify_queue *notify_queue_new(unsigned int size,
+						enum notify_policy policy)
+{
+	struct notify_queue *queue;
+
+	if (policy == NOTIFY_COALESCE_LATEST)
+		size = 1;
+
+	if (!size || size > NOTIFY_QUEUE_MAX_LEN)
+		return NULL;
+
+	queue = g_malloc(sizeof(*queue) + size * sizeof(struct notify_entry));
+	queue->policy = policy;
+	queue->size = size;
+	queue->head = 0;
+	queue->count = 0;
+
+	return queue;
+}
+
+/**
+ * @brief This function is used to free a notification queue.
+ *
+ * @param queue A pointer to the queue, may be NULL.
+ */
+void notify_queue_free(struct notify_queue *queue)
+{
+	g_free(queue);
+}
+
+/**
+ * @brief This function is used to queue a notification.
+ *
+ * @param queue     A pointer to the queue.
+ * @param value     A pointer to the value, copied into the queue.
+ * @param len       Length of the value.
+ * @param queued_at The time the value was written, see stats_now().
+ *
+ * @return The number of notifications dropped to stay within bounds, 0 or 1.
+ */
+unsigned int notify_queue_push(struct notify_queue *queue,
+				const uint8_t *value, int len,
+				uint64_t queued_at)
+{
+	struct notify_entry *entry;
+	unsigned int dropped = 0;
+
+	if (len > ATT_MAX_VALUE_LEN)
+		len = ATT_MAX_VALUE_LEN;
+
+	if (queue->count == queue->size) {
+		switch (queue->policy) {
+		case NOTIFY_DROP_NEWEST:
+			return 1;
+		case NOTIFY_DROP_OLDEST:
+		case NOTIFY_COALESCE_LATEST:
+			queue->head = (queue->head + 1) % queue->size;
+			queue->count--;
+			dropped = 1;
+			break;
+		}
+	}
+
+	entry = &queue->entries[(queue->head + queue->count) % queue->size];
+	entry->queued_at = queued_at;
+	entry->len = len;
+	memcpy(entry->value, value, len);
+
+	queue->count++;
+
+	return dropped;
+}
+
+/**
+ * @brief This function is used to look at the oldest queued notification.
+ *
+ * @param queue     A pointer to the queue.
+ * @param value     Updated with a pointer to the value.
+ * @param len       Updated with the length of the value.
+ * @param queued_at Updated with the time the value was queued, may be NULL.
+ *
+ * @return false if the queue is empty.
+ */
+bool notify_queue_peek(struct notify_queue *queue, const uint8_t **value,
+					int *len, uint64_t *queued_at)
+{
+	struct notify_entry *entry;
+
+	if (!queue->count)
+		return false;
+
+	entry = &queue->entries[queue->head];
+	*value = entry->value;
+	*len = entry->len;
+
+	if (queued_at)
+		*queued_at = entry->queued_at;
+
+	return true;
+}
+
+/**
+ * @brief This function is used to remove the oldest queued notification.
+ *
+ * @param queue A pointer to the queue.
+ */
+void notify_queue_pop(struct notify_queue *queue)
+{
+	if (!queue->count)
+		return;
+
+	queue->head = (queue->head + 1) % queue->size;
+	queue->count--;
+}
+
+/**
+ * @brief This function is used to get the number of queued notifications.
+ *
+ * @param queue A pointer to the queue, may be NULL.
+ *
+ * @return The number of queued notifications.
+ */
+unsigned int notify_queue_length(const struct notify_queue *queue)
+{
+	return queue ? queue->count : 0;
+}
+
+/**
+ * @brief This function is used to parse a policy name.
+ *
+ * @param name      One of "drop-oldest", "drop-newest" or "coalesce-latest".
+ * @param policy    Updated with the policy.
+ *
+ * @return 0 on success, -EINVAL if the name is unknown.
+ */
+int notify_policy_from_string(const char *name, enum notify_policy *policy)
+{
+	static const char *names[] = {
+		[NOTIFY_DROP_OLDEST]		= "drop-oldest",
+		[NOTIFY_DROP_NEWEST]		= "drop-newest",
+		[NOTIFY_COALESCE_LATEST]	= "coalesce-latest",
+	};
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(names); i++) {
+		if (strcasecmp(name, names[i]))
+			continue;
+
+		*policy = i;
+		return 0;
+	}
+
+	return -EINVAL;
+}
@@ -0,0 +1,451 @@
+/**
+ * @file objmgr.c
+ * @brief ObjectManager for the GATT application with a cached reply.
+ *
+ * Every interface of the application is registered through
+ * object_register(), which keeps a registry next to gdbus' own. The
+ * GetManagedObjects reply is marshalled from the registry in one pass and
+ * kept, later calls only copy it and fill in the reply serial. It is
+ * rebuilt when an interface comes or goes or when a property changed since,
+ * so it is never stale.
+ *
+ * InterfacesAdded is batched per object path and sent from an idle callback,
+ * registering a whole service instance costs one signal per object.
+ */
+
+#include "hrp.h"
+
+/**
+ * @struct om_iface
+ * Represents one interface registered on an object
+ */
+struct om_iface {
+	const char *name;
+	const GDBusPropertyTable *props;
+	void *data;
+	bool announced;
+};
+
+/**
+ * @struct om_object
+ * Represents one object path and its interfaces in registration order
+ */
+struct om_object {
+	char *path;
+	GSList *ifaces;
+	bool pending;
+};
+
+/**
+ * @struct object_manager
+ * Represents the ObjectManager exported on "/" of one connection
+ */
+struct object_manager {
+	DBusConnection *conn;
+	GHashTable *paths;
+	GQueue objects;
+	GSList *pending;
+	guint flush_source;
+	DBusMessage *cache;
+};
+
+/**
+ * @brief This function is used to append the properties of an interface as
+ * an a{sv} dictionary, the way gdbus does for GetAll.
+ *
+ * @param iter  A pointer to the iterator to append to.
+ * @param iface A pointer to the interface.
+ */
+static void append_properties(DBusMessageIter *iter, struct om_iface *iface)
+{
+	const GDBusPropertyTable *p;
+	DBusMessageIter dict;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+
+	for (p = iface->props; p && p->name; p++) {
+		DBusMessageIter entry, value;
+
+		if (!p->get || (p->exists && !p->exists(p, iface->data)))
+			continue;
+
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+								&p->name);
+		dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+							p->type, &value);
+		p->get(p, &value, iface->data);
+		dbus_message_iter_close_container(&entry, &value);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(iter, &dict);
+}
+
+/**
+ * @brief This function is used to append the interfaces of an object as an
+ * a{sa{sv}} dictionary.
+ *
+ * @param iter      A pointer to the iterator to append to.
+ * @param obj       A pointer to the object.
+ * @param announce  Only append interfaces not announced yet and mark them.
+ */
+static void append_interfaces(DBusMessageIter *iter, struct om_object *obj,
+								bool announce)
+{
+	DBusMessageIter array;
+	GSList *l;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sa{sv}}",
+								&array);
+
+	for (l = obj->ifaces; l; l = l->next) {
+		struct om_iface *iface = l->data;
+		DBusMessageIter entry;
+
+		if (announce) {
+			if (iface->announced)
+				continue;
+
+			iface->announced = true;
+		}
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+								&iface->name);
+		append_properties(&entry, iface);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(iter, &array);
+}
+
+/**
+ * @brief This function is used to drop the cached GetManagedObjects reply.
+ *
+ * @param om    A pointer to the ObjectManager.
+ */
+void object_manager_invalidate(struct object_manager *om)
+{
+	if (!om->cache)
+		return;
+
+	dbus_message_unref(om->cache);
+	om->cache = NULL;
+}
+
+/**
+ * @brief This function is used to marshal the GetManagedObjects reply of
+ * the whole tree, unless it is cached already.
+ *
+ * @param om    A pointer to the ObjectManager.
+ *
+ * @return A pointer to the cached reply or NULL if out of memory.
+ */
+DBusMessage *object_manager_build(struct object_manager *om)
+{
+	DBusMessageIter iter, array;
+	GList *l;
+
+	if (om->cache)
+		return om->cache;
+
+	om->cache = dbus_message_new(DBUS_MESSAGE_TYPE_METHOD_RETURN);
+	if (!om->cache)
+		return NULL;
+
+	dbus_message_iter_init_append(om->cache, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}",
+								&array);
+
+	for (l = om->objects.head; l; l = l->next) {
+		struct om_object *obj = l->data;
+		DBusMessageIter entry;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+								&obj->path);
+		append_interfaces(&entry, obj, false);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return om->cache;
+}
+
+/**
+ * @brief This function is used to handle the GetManagedObjects method call.
+ *
+ * @param conn      A pointer to the DBusConnection.
+ * @param msg       A pointer to the DBusMessage.
+ * @param user_data A pointer to the ObjectManager.
+ *
+ * @return The reply message.
+ */
+static DBusMessage *get_managed_objects(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	DBusMessage *cache = object_manager_build(user_data);
+
+	if (!cache)
+		return NULL;
+
+	return reply_from_cache(cache, msg);
+}
+
+static const GDBusMethodTable om_methods[] = {
+	{ GDBUS_METHOD("GetManagedObjects", NULL,
+		GDBUS_ARGS({ "objects", "a{oa{sa{sv}}}" }),
+		get_managed_objects) },
+	{ }
+};
+
+static const GDBusSignalTable om_signals[] = {
+	{ GDBUS_SIGNAL("InterfacesAdded",
+		GDBUS_ARGS({ "object", "o" },
+			{ "interfaces", "a{sa{sv}}" })) },
+	{ GDBUS_SIGNAL("InterfacesRemoved",
+		GDBUS_ARGS({ "object", "o" }, { "interfaces", "as" })) },
+	{ }
+};
+
+/**
+ * @brief This function is used as the idle callback sending one
+ * InterfacesAdded per object that got new interfaces.
+ *
+ * @param user_data A pointer to the ObjectManager.
+ *
+ * @return FALSE, the callback runs once.
+ */
+static gboolean om_flush(gpointer user_data)
+{
+	struct object_manager *om = user_data;
+
+	om->flush_source = 0;
+	om->pending = g_slist_reverse(om->pending);
+
+	while (om->pending) {
+		struct om_object *obj = om->pending->data;
+		DBusMessageIter iter;
+		DBusMessage *signal;
+
+		om->pending = g_slist_delete_link(om->pending, om->pending);
+		obj->pending = false;
+
+		signal = dbus_message_new_signal("/", OBJECT_MANAGER_IFACE,
+							"InterfacesAdded");
+		if (!signal)
+			continue;
+
+		dbus_message_iter_init_append(signal, &iter);
+		dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH,
+								&obj->path);
+		append_interfaces(&iter, obj, true);
+
+		g_dbus_send_message(om->conn, signal);
+	}
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to queue an object for the next
+ * InterfacesAdded batch.
+ *
+ * @param om    A pointer to the ObjectManager.
+ * @param obj   A pointer to the object.
+ */
+static void om_announce(struct object_manager *om, struct om_object *obj)
+{
+	if (obj->pending)
+		return;
+
+	obj->pending = true;
+	om->pending = g_slist_prepend(om->pending, obj);
+
+	if (!om->flush_source)
+		om->flush_source = g_idle_add(om_flush, om);
+}
+
+/**
+ * @brief This function is used to free an object of the registry.
+ *
+ * @param obj   A pointer to the object.
+ */
+static void om_object_free(struct om_object *obj)
+{
+	g_slist_free_full(obj->ifaces, g_free);
+	g_free(obj->path);
+	g_free(obj);
+}
+
+/**
+ * @brief This function is used to export the ObjectManager on "/" in place
+ * of gdbus' own, see g_dbus_attach_object_manager().
+ *
+ * There is one per connection, since it owns "/" there.
+ *
+ * @param conn  A pointer to the DBusConnection.
+ *
+ * @return A pointer to the ObjectManager or NULL on error.
+ */
+struct object_manager *object_manager_attach(DBusConnection *conn)
+{
+	struct object_manager *om;
+
+	om = g_new0(struct object_manager, 1);
+
+	if (!g_dbus_register_interface(conn, "/", OBJECT_MANAGER_IFACE,
+					om_methods, om_signals, NULL, om,
+					NULL)) {
+		g_free(om);
+		return NULL;
+	}
+
+	om->conn = dbus_connection_ref(conn);
+	om->paths = g_hash_table_new(g_str_hash, g_str_equal);
+	g_queue_init(&om->objects);
+
+	return om;
+}
+
+/**
+ * @brief This function is used to remove the ObjectManager from "/" and
+ * free it. Interfaces still registered are dropped from the registry only.
+ *
+ * @param om    A pointer to the ObjectManager, may be NULL.
+ */
+void object_manager_detach(struct object_manager *om)
+{
+	struct om_object *obj;
+
+	if (!om)
+		return;
+
+	if (om->flush_source)
+		g_source_remove(om->flush_source);
+
+	g_slist_free(om->pending);
+
+	while ((obj = g_queue_pop_head(&om->objects)))
+		om_object_free(obj);
+
+	g_hash_table_destroy(om->paths);
+
+	g_dbus_unregister_interface(om->conn, "/", OBJECT_MANAGER_IFACE);
+	dbus_connection_unref(om->conn);
+
+	object_manager_invalidate(om);
+	g_free(om);
+}
+
+/**
+ * @brief This function is used to register an interface with gdbus and in
+ * the registry the ObjectManager answers from.
+ *
+ * Takes the same arguments as g_dbus_register_interface(), the connection
+ * is the one of the ObjectManager.
+ *
+ * @return TRUE on success.
+ */
+gboolean object_register(struct object_manager *om, const char *path,
+				const char *name,
+				const GDBusMethodTable *methods,
+				const GDBusSignalTable *signals,
+				const GDBusPropertyTable *props,
+				void *data, GDBusDestroyFunction destroy)
+{
+	struct om_object *obj;
+	struct om_iface *iface;
+
+	if (!g_dbus_register_interface(om->conn, path, name, methods, signals,
+						props, data, destroy))
+		return FALSE;
+
+	obj = g_hash_table_lookup(om->paths, path);
+	if (!obj) {
+		obj = g_new0(struct om_object, 1);
+		obj->path = g_strdup(path);
+		g_hash_table_insert(om->paths, obj->path, obj);
+		g_queue_push_tail(&om->objects, obj);
+	}
+
+	iface = g_new0(struct om_iface, 1);
+	iface->name = g_intern_string(name);
+	iface->props = props;
+	iface->data = data;
+	obj->ifaces = g_slist_append(obj->ifaces, iface);
+
+	object_manager_invalidate(om);
+	om_announce(om, obj);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used to unregister an interface registered with
+ * object_register().
+ *
+ * @param om    A pointer to the ObjectManager.
+ * @param path  The object path.
+ * @param name  The interface name.
+ *
+ * @return TRUE on success.
+ */
+gboolean object_unregister(struct object_manager *om, const char *path,
+							const char *name)
+{
+	struct om_object *obj = g_hash_table_lookup(om->paths, path);
+	GSList *l;
+
+	for (l = obj ? obj->ifaces : NULL; l; l = l->next) {
+		struct om_iface *iface = l->data;
+		const char **names = &iface->name;
+
+		if (strcmp(iface->name, name))
+			continue;
+
+		if (iface->announced)
+			g_dbus_emit_signal(om->conn, "/", OBJECT_MANAGER_IFACE,
+					"InterfacesRemoved",
+					DBUS_TYPE_OBJECT_PATH, &obj->path,
+					DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+					&names, 1, DBUS_TYPE_INVALID);
+
+		obj->ifaces = g_slist_delete_link(obj->ifaces, l);
+		g_free(iface);
+		break;
+	}
+
+	if (obj && !obj->ifaces) {
+		if (obj->pending)
+			om->pending = g_slist_remove(om->pending, obj);
+
+		g_queue_remove(&om->objects, obj);
+		g_hash_table_remove(om->paths, obj->path);
+		om_object_free(obj);
+	}
+
+	object_manager_invalidate(om);
+
+	return g_dbus_unregister_interface(om->conn, path, name);
+}
+
+/**
+ * @brief This function is used to emit PropertiesChanged and drop the
+ * cached GetManagedObjects reply, which holds the old value.
+ *
+ * Takes the same arguments as g_dbus_emit_property_changed(), the
+ * connection is the one of the ObjectManager.
+ */
+void object_property_changed(struct object_manager *om, const char *path,
+					const char *iface, const char *name)
+{
+	object_manager_invalidate(om);
+
+	g_dbus_emit_property_changed(om->conn, path, iface, name);
+}
@@ -0,0 +1,233 @@
+/**
+ * @file ring.c
+ * @brief Lock-free sample ring between a sensor thread and the main loop.
+ *
+ * The producer thread only ever writes head, the main loop only ever writes
+ * tail, so a pair of acquire/release operations is all the synchronization
+ * needed. An eventfd wakes up the main loop when a push finds the ring
+ * drained, the consumer then empties it in one go.
+ */
+
+#include "hrp.h"
+
+#define SAMPLE_RING_ALIGN       64
+
+/**
+ * @struct sample_ring
+ * Represents the ring, head and tail live on separate cache lines
+ */
+struct sample_ring {
+	_Alignas(SAMPLE_RING_ALIGN) atomic_uint head;
+	_Alignas(SAMPLE_RING_ALIGN) atomic_uint tail;
+	_Alignas(SAMPLE_RING_ALIGN) unsigned int mask;
+	int efd;
+	guint watch;
+	sample_ring_func_t func;
+	void *user_data;
+	struct hr_sample samples[];
+};
+
+/**
+ * @brief This function is used to create a sample ring.
+ *
+ * @param size  Number of samples, rounded up to a power of two.
+ *
+ * @return A pointer to the ring or NULL on error.
+ */
+struct sample_ring *sample_ring_new(unsigned int size)
+{
+	struct sample_ring *ring;
+	unsigned int n = 1;
+	size_t len;
+
+	if (!size || size > (1U << 20))
+		return NULL;
+
+	while (n < size)
+		n <<= 1;
+
+	/* g_malloc() only aligns to 16 bytes, too little for the cache lines */
+	len = sizeof(*ring) + n * sizeof(struct hr_sample);
+	if (posix_memalign((void **) &ring, SAMPLE_RING_ALIGN, len))
+		return NULL;
+
+	memset(ring, 0, len);
+	ring->mask = n - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+/**
+ * @brief This function is used to free a sample ring.
+ *
+ * @param ring  A pointer to the ring.
+ */
+void sample_ring_free(struct sample_ring *ring)
+{
+	if (!ring)
+		return;
+
+	if (ring->watch)
+		g_source_remove(ring->watch);
+
+	close(ring->efd);
+	free(ring);
+}
+
+/**
+ * @brief This function is used to push a sample from the producer thread.
+ *
+ * @param ring      A pointer to the ring.
+ * @param sample    A pointer to the sample.
+ *
+ * @return false if the ring is full.
+ */
+bool sample_ring_push(struct sample_ring *ring, const struct hr_sample *sample)
+{
+	unsigned int head, tail;
+	uint64_t one = 1;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail > ring->mask)
+		return false;
+
+	ring->samples[head & ring->mask] = *sample;
+
+	/*
+	 * Sequentially consistent against sample_ring_consume() and the peek
+	 * after it: either this sees everything before the sample consumed
+	 * and signals, or the consumer's next peek sees the sample.
+	 */
+	atomic_store_explicit(&ring->head, head + 1, memory_order_seq_cst);
+
+	/* The loop is busy with earlier samples and picks this one up too */
+	if (atomic_load_explicit(&ring->tail, memory_order_seq_cst) != head)
+		return true;
+
+	/* A saturated counter still wakes up the loop, so EAGAIN is fine */
+	if (write(ring->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		hrp_warn("sample ring: %s", strerror(errno));
+
+	return true;
+}
+
+/**
+ * @brief This function is used to get the contiguous run of pending samples.
+ *
+ * @param ring      A pointer to the ring.
+ * @param samples   Updated with a pointer to the first pending sample.
+ *
+ * @return Number of samples available at samples.
+ */
+unsigned int sample_ring_peek(struct sample_ring *ring,
+					const struct hr_sample **samples)
+{
+	unsigned int head, tail, idx, count;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_seq_cst);
+
+	count = head - tail;
+	if (!count)
+		return 0;
+
+	idx = tail & ring->mask;
+
+	/* Stop at the end of the buffer, the rest comes with the next peek */
+	if (count > ring->mask + 1 - idx)
+		count = ring->mask + 1 - idx;
+
+	*samples = &ring->samples[idx];
+
+	return count;
+}
+
+/**
+ * @brief This function is used to release consumed samples back to the
+ * producer. The consumer keeps peeking until nothing is left, a push only
+ * signals a drained ring.
+ *
+ * @param ring  A pointer to the ring.
+ * @param count Number of samples consumed.
+ */
+void sample_ring_consume(struct sample_ring *ring, unsigned int count)
+{
+	unsigned int tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + count, memory_order_seq_cst);
+}
+
+/**
+ * @brief This function is used as a callback when the producer signalled the
+ * eventfd.
+ *
+ * @param channel   A pointer to GIOChannel.
+ * @param cond      The condition that triggered the callback.
+ * @param user_data A pointer to user defined data.
+ *
+ * @return TRUE to keep the watch.
+ */
+static gboolean sample_ring_cb(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct sample_ring *ring = user_data;
+	uint64_t count;
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		ring->watch = 0;
+		return FALSE;
+	}
+
+	/* Clear the counter first so pushes racing with the drain re-arm it */
+	if (read(ring->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		hrp_warn("sample ring: %s", strerror(errno));
+
+	ring->func(ring, ring->user_data);
+
+	return TRUE;
+}
+
+/**
+ * @brief This function is used to hook the ring's eventfd into the main loop.
+ *
+ * @param ring      A pointer to the ring.
+ * @param func      The function called when samples are available.
+ * @param user_data A pointer passed to func.
+ *
+ * @return The source id, 0 on error.
+ */
+guint sample_ring_attach(struct sample_ring *ring, sample_ring_func_t func,
+							void *user_data)
+{
+	GIOChannel *channel;
+
+	if (!ring || !func || ring->watch)
+		return 0;
+
+	ring->func = func;
+	ring->user_data = user_data;
+
+	channel = g_io_channel_unix_new(ring->efd);
+
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	ring->watch = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				sample_ring_cb, ring);
+
+	g_io_channel_unref(channel);
+
+	return ring->watch;
+}
@@ -0,0 +1,264 @@
+/**
+ * @file sensor.c
+ * @brief Sensor acquisition thread started next to the main loop.
+ *
+ * Bringing up a sensor can take a long time, so it never happens on the
+ * main loop. The services are registered with placeholder values while the
+ * sensor thread initialises, then its samples flow in through a sample ring.
+ * The main loop learns about the outcome of the initialisation from an idle
+ * callback holding a reference on the sensor.
+ */
+
+#include "hrp.h"
+
+enum sensor_status {
+	SENSOR_STARTING,
+	SENSOR_READY,
+	SENSOR_FAILED,
+};
+
+/**
+ * @struct sensor
+ * Represents the sensor thread and the ring it fills
+ */
+struct sensor {
+	atomic_int refs;
+	struct sample_ring *ring;
+	GThread *thread;
+	sensor_func_t func;
+	void *user_data;
+	GMutex lock;
+	GCond cond;
+	bool stopping;
+	atomic_int status;
+	int err;
+	uint64_t started;
+};
+
+/**
+ * @brief This function is used to drop a reference on a sensor.
+ *
+ * @param data  A pointer to the sensor.
+ */
+static void sensor_unref(gpointer data)
+{
+	struct sensor *sensor = data;
+
+	if (atomic_fetch_sub_explicit(&sensor->refs, 1,
+					memory_order_acq_rel) != 1)
+		return;
+
+	sample_ring_free(sensor->ring);
+	g_mutex_clear(&sensor->lock);
+	g_cond_clear(&sensor->cond);
+	g_free(sensor);
+}
+
+/**
+ * @brief This function is used as the idle callback reporting the outcome
+ * of the initialisation on the main loop.
+ *
+ * @param user_data A pointer to the sensor.
+ *
+ * @return FALSE, the callback runs once.
+ */
+static gboolean sensor_report_cb(gpointer user_data)
+{
+	struct sensor *sensor = user_data;
+	uint64_t elapsed = (stats_now() - sensor->started) / 1000000;
+
+	if (sensor_stopping(sensor))
+		return FALSE;
+
+	if (atomic_load(&sensor->status) == SENSOR_READY)
+		hrp_info("Sensor ready after %llu ms",
+					(unsigned long long) elapsed);
+	else
+		hrp_error("Sensor failed after %llu ms: %s",
+					(unsigned long long) elapsed,
+					strerror(-sensor->err));
+
+	return FALSE;
+}
+
+/**
+ * @brief This function is used to move a sensor to a new status and tell the
+ * main loop about it.
+ *
+ * @param sensor    A pointer to the sensor.
+ * @param status    The new status.
+ */
+static void sensor_report(struct sensor *sensor, enum sensor_status status)
+{
+	int expected = SENSOR_STARTING;
+
+	if (!atomic_compare_exchange_strong(&sensor->status, &expected, status))
+		return;
+
+	atomic_fetch_add_explicit(&sensor->refs, 1, memory_order_relaxed);
+	g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, sensor_report_cb, sensor,
+								sensor_unref);
+}
+
+/**
+ * @brief This function is used as the body of the sensor thread.
+ *
+ * @param data  A pointer to the sensor.
+ *
+ * @return NULL.
+ */
+static gpointer sensor_thread(gpointer data)
+{
+	struct sensor *sensor = data;
+	int err;
+
+	err = sensor->func(sensor, sensor->user_data);
+	if (err < 0 && !sensor_stopping(sensor)) {
+		sensor->err = err;
+		sensor_report(sensor, SENSOR_FAILED);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief This function is used to start a sensor thread feeding the heart
+ * rate service.
+ *
+ * The ring is attached to the main loop before the thread starts, func runs
+ * on the thread and is expected to call sensor_ready() once the sensor
+ * delivers, then sensor_push() samples until sensor_wait() returns false.
+ *
+ * @param hrp       A pointer to the context fed by the sensor.
+ * @param func      The function run on the sensor thread.
+ * @param size      Number of samples the ring holds.
+ * @param user_data A pointer passed to func.
+ *
+ * @return A pointer to the sensor or NULL on error.
+ */
+struct sensor *sensor_start(struct hrp *hrp, sensor_func_t func,
+					unsigned int size, void *user_data)
+{
+	struct sensor *sensor;
+	GError *gerr = NULL;
+
+	sensor = g_new0(struct sensor, 1);
+	atomic_init(&sensor->refs, 1);
+	atomic_init(&sensor->status, SENSOR_STARTING);
+	sensor->func = func;
+	sensor->user_data = user_data;
+	sensor->started = stats_now();
+	g_mutex_init(&sensor->lock);
+	g_cond_init(&sensor->cond);
+
+	sensor->ring = sample_ring_new(size);
+	if (!sensor->ring || !attach_sample_ring(hrp, sensor->ring)) {
+		hrp_error("Couldn't create the sample ring");
+		sensor_unref(sensor);
+		return NULL;
+	}
+
+	sensor->thread = g_thread_try_new("sensor", sensor_thread, sensor,
+									&gerr);
+	if (!sensor->thread) {
+		hrp_error("Couldn't start the sensor thread: %s",
+							gerr->message);
+		g_error_free(gerr);
+		sensor_unref(sensor);
+		return NULL;
+	}
+
+	return sensor;
+}
+
+/**
+ * @brief This function is used to stop the sensor thread and wait for it.
+ *
+ * @param sensor    A pointer to the sensor, may be NULL.
+ */
+void sensor_stop(struct sensor *sensor)
+{
+	if (!sensor)
+		return;
+
+	g_mutex_lock(&sensor->lock);
+	sensor->stopping = true;
+	g_cond_broadcast(&sensor->cond);
+	g_mutex_unlock(&sensor->lock);
+
+	g_thread_join(sensor->thread);
+
+	/* Nothing comes in anymore, a pending report keeps the rest alive */
+	sample_ring_free(sensor->ring);
+	sensor->ring = NULL;
+
+	sensor_unref(sensor);
+}
+
+/**
+ * @brief This function is used by the sensor thread once the sensor
+ * delivers real values.
+ *
+ * @param sensor    A pointer to the sensor.
+ */
+void sensor_ready(struct sensor *sensor)
+{
+	sensor_report(sensor, SENSOR_READY);
+}
+
+/**
+ * @brief This function is used by the sensor thread to push a sample.
+ *
+ * @param sensor    A pointer to the sensor.
+ * @param sample    A pointer to the sample, copied into the ring.
+ *
+ * @return false if the ring is full and the sample was dropped.
+ */
+bool sensor_push(struct sensor *sensor, const struct hr_sample *sample)
+{
+	return sample_ring_push(sensor->ring, sample);
+}
+
+/**
+ * @brief This function is used to tell whether the sensor is being stopped.
+ *
+ * @param sensor    A pointer to the sensor.
+ *
+ * @return true once sensor_stop() was called.
+ */
+bool sensor_stopping(struct sensor *sensor)
+{
+	bool stopping;
+
+	g_mutex_lock(&sensor->lock);
+	stopping = sensor->stopping;
+	g_mutex_unlock(&sensor->lock);
+
+	return stopping;
+}
+
+/**
+ * @brief This function is used by the sensor thread to sleep, waking up
+ * early when the sensor is being stopped.
+ *
+ * @param sensor    A pointer to the sensor.
+ * @param msec      How long to sleep in milliseconds.
+ *
+ * @return false if the thread should return.
+ */
+bool sensor_wait(struct sensor *sensor, unsigned int msec)
+{
+	gint64 end = g_get_monotonic_time() + msec * G_TIME_SPAN_MILLISECOND;
+	bool stopping;
+
+	g_mutex_lock(&sensor->lock);
+
+	while (!sensor->stopping &&
+			g_cond_wait_until(&sensor->cond, &sensor->lock, end))
+		;
+
+	stopping = sensor->stopping;
+	g_mutex_unlock(&sensor->lock);
+
+	return !stopping;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file state.c
+ * @brief Memory-mapped snapshot of the state worth keeping across restarts.
+ *
+ * The file is a single fixed-size struct hrp_state mapped shared, so
+ * updating it is a plain store into the mapping. The kernel owns the dirty
+ * pages, which survive a crash of the process; state_sync() additionally
+ * schedules write-back for upgrades and power loss.
+ */
+
+#include "hrp.h"
+
+/**
+ * @brief This function is used to map the state file, creating it or
+ * starting over when it is missing, truncated or of another version.
+ *
+ * @param path  The path of the state file.
+ * @param out   A pointer to store the mapped state into.
+ *
+ * @return 0 on success or a negative error code.
+ */
+int state_open(const char *path, struct hrp_state **out)
+{
+	struct hrp_state *state;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 || (st.st_size != sizeof(*state) &&
+				ftruncate(fd, sizeof(*state)) < 0)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	map = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED,
+								fd, 0);
+	err = -errno;
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return err;
+
+	state = map;
+
+	if (st.st_size != sizeof(*state) || state->magic != HRP_STATE_MAGIC ||
+				state->version != HRP_STATE_VERSION) {
+		hrp_info("State file %s: starting over", path);
+		memset(state, 0, sizeof(*state));
+		state->magic = HRP_STATE_MAGIC;
+		state->version = HRP_STATE_VERSION;
+		state_sync(state);
+	}
+
+	*out = state;
+
+	return 0;
+}
+
+/**
+ * @brief This function is used to unmap the state file.
+ *
+ * @param state A pointer to the mapped state, may be NULL.
+ */
+void state_close(struct hrp_state *state)
+{
+	if (!state)
+		return;
+
+	msync(state, sizeof(*state), MS_SYNC);
+	munmap(state, sizeof(*state));
+}
+
+/**
+ * @brief This function is used to schedule write-back of the state after it
+ * changed. It does not wait for the disk.
+ *
+ * @param state A pointer to the mapped state, may be NULL.
+ */
+void state_sync(struct hrp_state *state)
+{
+	if (state)
+		msync(state, sizeof(*state), MS_ASYNC);
+}
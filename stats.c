@@ -0,0 +1,164 @@
+/**
+ * @file stats.c
+ * @brief Per-characteristic counters and latency histograms.
+ *
+ * All counters are relaxed atomics, so they can be bumped from the main loop
+ * and read from anywhere without taking a lock. Histograms use fixed
+ * power-of-two buckets in microseconds.
+ */
+
+#include "hrp.h"
+
+/**
+ * @brief This function is used to read the monotonic clock.
+ *
+ * @return The current time in nanoseconds.
+ */
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief This function is used to map a duration to its histogram bucket.
+ *
+ * Bucket 0 holds everything below 1us, bucket i holds [2^(i-1), 2^i) us and
+ * the last bucket everything above.
+ *
+ * @param ns    The duration in nanoseconds.
+ *
+ * @return The bucket index.
+ */
+static unsigned int stats_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int bucket;
+
+	if (!us)
+		return 0;
+
+	bucket = 64 - __builtin_clzll(us);
+
+	return MIN(bucket, HRP_STATS_BUCKETS - 1);
+}
+
+/**
+ * @brief This function is used to record a duration in a histogram.
+ *
+ * @param hist  The histogram buckets.
+ * @param start The start time as returned by stats_now().
+ */
+void stats_record(atomic_uint_fast64_t *hist, uint64_t start)
+{
+	uint64_t now = stats_now();
+
+	atomic_fetch_add_explicit(&hist[stats_bucket(now - start)], 1,
+						memory_order_relaxed);
+}
+
+/**
+ * @brief This function is used to record the end of a D-Bus method handler.
+ *
+ * @param stats     A pointer to the statistics.
+ * @param start     The time the handler was entered.
+ * @param failed    Whether the handler replied with an error.
+ */
+void stats_handler_done(struct chr_stats *stats, uint64_t start, bool failed)
+{
+	uint64_t now = stats_now();
+
+	atomic_fetch_add_explicit(&stats->handler_ns, now - start,
+						memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->handler[stats_bucket(now - start)], 1,
+						memory_order_relaxed);
+
+	if (failed)
+		stats_inc(&stats->errors);
+}
+
+/**
+ * @brief This function is used to clear all counters and restart the rate
+ * measurement.
+ *
+ * @param stats A pointer to the statistics.
+ */
+void stats_reset(struct chr_stats *stats)
+{
+	unsigned int i;
+
+	atomic_store_explicit(&stats->writes, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->reads, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->notifications, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->errors, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->drops, 0, memory_order_relaxed);
+	atomic_store_explicit(&stats->handler_ns, 0, memory_order_relaxed);
+
+	for (i = 0; i < HRP_STATS_BUCKETS; i++) {
+		atomic_store_explicit(&stats->latency[i], 0,
+						memory_order_relaxed);
+		atomic_store_explicit(&stats->handler[i], 0,
+						memory_order_relaxed);
+	}
+
+	stats->since = stats_now();
+}
+
+/**
+ * @brief This function is used to print one histogram as a single line.
+ *
+ * @param name  The name of the histogram.
+ * @param hist  The histogram buckets.
+ */
+static void stats_print_histogram(const char *name,
+					const atomic_uint_fast64_t *hist)
+{
+	char line[HRP_STATS_BUCKETS * 22];
+	unsigned int i;
+	int off = 0;
+
+	for (i = 0; i < HRP_STATS_BUCKETS; i++)
+		off += snprintf(line + off, sizeof(line) - off, " %llu",
+				(unsigned long long) atomic_load_explicit(
+					&hist[i], memory_order_relaxed));
+
+	hrp_log_print(HRP_LOG_INFO, "  %s:%s", name, line);
+}
+
+/**
+ * @brief This function is used to print the statistics of one attribute.
+ *
+ * Printed regardless of the log level, the dump is explicitly requested.
+ *
+ * @param path  The object path of the attribute.
+ * @param stats A pointer to the statistics.
+ */
+void stats_dump(const char *path, const struct chr_stats *stats)
+{
+	uint64_t elapsed = stats_now() - stats->since;
+	uint64_t notifications = atomic_load_explicit(&stats->notifications,
+						memory_order_relaxed);
+
+	hrp_log_print(HRP_LOG_INFO,
+		"%s: writes %llu reads %llu notifications %llu (%.1f/s) "
+		"errors %llu drops %llu handler %llu us",
+		path,
+		(unsigned long long) atomic_load_explicit(&stats->writes,
+						memory_order_relaxed),
+		(unsigned long long) atomic_load_explicit(&stats->reads,
+						memory_order_relaxed),
+		(unsigned long long) notifications,
+		elapsed ? notifications * 1e9 / elapsed : 0.0,
+		(unsigned long long) atomic_load_explicit(&stats->errors,
+						memory_order_relaxed),
+		(unsigned long long) atomic_load_explicit(&stats->drops,
+						memory_order_relaxed),
+		(unsigned long long) atomic_load_explicit(&stats->handler_ns,
+						memory_order_relaxed) / 1000);
+
+	stats_print_histogram("latency", stats->latency);
+	stats_print_histogram("handler", stats->handler);
+}
@@ -0,0 +1,237 @@
+/**
+ * @file trace.c
+ * @brief Replay of recorded heart rate traces as a sensor.
+ *
+ * A trace is a little-endian binary file, a 16 byte header followed by
+ * fixed-size records:
+ *
+ *     header: u32 magic "HRPT", u16 version, u16 record size,
+ *             u32 record count, u32 reserved
+ *     record: u32 time in ms, u16 heart rate, u8 contact, u8 RR count,
+ *             u16 RR[4] in 1/1024 s, u16 energy since the last record in J,
+ *             u16 reserved
+ *
+ * Records larger than that are accepted, the tail is ignored. The file is
+ * mapped read-only and decoded record by record, it never lands on the heap
+ * and the page cache is shared by all processes replaying it. One sensor
+ * thread feeds every instance, each starting at another point of the trace.
+ */
+
+#include "hrp.h"
+
+#define TRACE_MAGIC             0x54505248	/* "HRPT" */
+#define TRACE_VERSION           1
+#define TRACE_HEADER_LEN        16
+#define TRACE_RECORD_MIN_LEN    18
+
+/**
+ * @struct trace
+ * Represents a mapped trace and how to replay it
+ */
+struct trace {
+	const uint8_t *map;
+	size_t size;
+	const uint8_t *records;
+	unsigned int record_len;
+	unsigned int count;
+	uint32_t first;
+	uint32_t duration;
+	double speed;
+	unsigned int sensors;
+};
+
+static inline uint16_t get_le16(const uint8_t *buf)
+{
+	return buf[0] | buf[1] << 8;
+}
+
+static inline uint32_t get_le32(const uint8_t *buf)
+{
+	return get_le16(buf) | (uint32_t) get_le16(buf + 2) << 16;
+}
+
+/**
+ * @brief This function is used to map and validate a trace.
+ *
+ * @param path      The path of the trace.
+ * @param speed     Replay rate relative to the recording, 0 for as fast as
+ *                  the main loop drains the samples.
+ * @param sensors   Number of instances fed from the trace.
+ *
+ * @return A pointer to the trace or NULL on error.
+ */
+struct trace *trace_open(const char *path, double speed, unsigned int sensors)
+{
+	struct trace *trace;
+	struct stat st;
+	const uint8_t *map;
+	unsigned int record_len, count;
+	uint32_t last;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		hrp_error("Trace %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < TRACE_HEADER_LEN) {
+		hrp_error("Trace %s: too short", path);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		hrp_error("Trace %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	record_len = get_le16(map + 6);
+	count = get_le32(map + 8);
+
+	if (get_le32(map) != TRACE_MAGIC || get_le16(map + 4) != TRACE_VERSION ||
+			record_len < TRACE_RECORD_MIN_LEN || !count ||
+			count > (st.st_size - TRACE_HEADER_LEN) / record_len) {
+		hrp_error("Trace %s: invalid header", path);
+		munmap((void *) map, st.st_size);
+		return NULL;
+	}
+
+	madvise((void *) map, st.st_size, MADV_SEQUENTIAL);
+
+	trace = g_new0(struct trace, 1);
+	trace->map = map;
+	trace->size = st.st_size;
+	trace->records = map + TRACE_HEADER_LEN;
+	trace->record_len = record_len;
+	trace->count = count;
+	trace->speed = speed;
+	trace->sensors = sensors ? sensors : 1;
+
+	/* A lap ends one average record interval after the last record */
+	trace->first = get_le32(trace->records);
+	last = get_le32(trace->records + (size_t) (count - 1) * record_len);
+	if (last > trace->first)
+		trace->duration = last - trace->first +
+				(last - trace->first) / MAX(count - 1, 1);
+
+	if (!trace->duration && speed > 0) {
+		hrp_error("Trace %s: no timing to replay at speed %g", path,
+									speed);
+		trace_close(trace);
+		return NULL;
+	}
+
+	hrp_info("Trace %s: %u records over %u ms", path, count,
+							trace->duration);
+
+	return trace;
+}
+
+/**
+ * @brief This function is used to unmap a trace. The sensor replaying it
+ * must be stopped first.
+ *
+ * @param trace A pointer to the trace, may be NULL.
+ */
+void trace_close(struct trace *trace)
+{
+	if (!trace)
+		return;
+
+	munmap((void *) trace->map, trace->size);
+	g_free(trace);
+}
+
+/**
+ * @brief This function is used to decode one record into a sample.
+ *
+ * @param trace     A pointer to the trace.
+ * @param index     The record index.
+ * @param sample    Updated with the record.
+ *
+ * @return The time of the record in milliseconds.
+ */
+static uint32_t trace_record(const struct trace *trace, unsigned int index,
+						struct hr_sample *sample)
+{
+	const uint8_t *rec = trace->records + (size_t) index * trace->record_len;
+	unsigned int i;
+
+	sample->hr = get_le16(rec + 4);
+	sample->contact = rec[6];
+	sample->rr_count = MIN(rec[7], HR_SAMPLE_MAX_RR);
+
+	for (i = 0; i < sample->rr_count; i++)
+		sample->rr[i] = get_le16(rec + 8 + 2 * i);
+
+	sample->energy = get_le16(rec + 16);
+
+	return get_le32(rec);
+}
+
+/**
+ * @brief This function is used as the sensor function replaying a trace in
+ * a loop, see sensor_start().
+ *
+ * The timing follows the first instance's records, scaled by the speed,
+ * the other instances are offset into the trace. A full ring makes the
+ * thread wait for the main loop rather than drop.
+ *
+ * @param sensor    A pointer to the sensor.
+ * @param user_data A pointer to the trace.
+ *
+ * @return 0 once the sensor is stopped.
+ */
+int trace_replay(struct sensor *sensor, void *user_data)
+{
+	struct trace *trace = user_data;
+	unsigned int stride = MAX(trace->count / trace->sensors, 1);
+	uint64_t start = stats_now(), lap = 0;
+	unsigned int index = 0;
+
+	sensor_ready(sensor);
+
+	while (!sensor_stopping(sensor)) {
+		struct hr_sample sample;
+		unsigned int i;
+		uint32_t time;
+
+		time = trace_record(trace, index, &sample);
+
+		if (trace->speed > 0) {
+			/* Records out of order are sent right away */
+			uint64_t ms = lap * trace->duration +
+					(time > trace->first ?
+						time - trace->first : 0);
+			uint64_t due = start + ms * 1e6 / trace->speed;
+			uint64_t now = stats_now();
+
+			if (due > now && !sensor_wait(sensor,
+					(due - now + 999999) / 1000000))
+				break;
+		}
+
+		for (i = 0; i < trace->sensors; i++) {
+			if (i)
+				trace_record(trace, (index + i * stride) %
+							trace->count, &sample);
+
+			sample.sensor = i;
+
+			while (!sensor_push(sensor, &sample))
+				if (!sensor_wait(sensor, 1))
+					return 0;
+		}
+
+		if (++index == trace->count) {
+			index = 0;
+			lap++;
+		}
+	}
+
+	return 0;
+}